@@ -0,0 +1,300 @@
+/*
+ * Checks the code msgpack-codegen generates for bench/check-codegen.schema.
+ *
+ * Each record is decoded both with rec_decode(), which takes the fast path
+ * when the record matches the schema exactly, and with rec_decode_generic(),
+ * and both must give the same size, the same fields and the same values.
+ * Records cover the exact layout, and every way to leave the fast path:
+ * other key order, missing, extra or non str keys, wrong types, other
+ * encodings of keys, values and map headers, and truncation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "check-codegen.h"
+
+static unsigned nb_failures;
+
+#define CHECK(cond) do { \
+  if (! (cond)) { \
+    fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+    nb_failures ++; \
+  } \
+} while (0)
+
+/*
+ * Building records
+ */
+
+static unsigned char buf[4096];
+static size_t len;
+
+static void put(void const *p, size_t n)
+{
+  memcpy(buf + len, p, n);
+  len += n;
+}
+
+static void put_byte(unsigned char c)
+{
+  buf[len++] = c;
+}
+
+static void put_be(uint64_t n, size_t w)
+{
+  while (w-- > 0) put_byte(n >> (w * 8));
+}
+
+static void put_str(char const *s)
+{
+  size_t const n = strlen(s);
+  if (n < 32) put_byte(0xa0 | n);
+  else { put_byte(0xd9); put_byte(n); }
+  put(s, n);
+}
+
+static void put_uint(uint64_t n)
+{
+  if (n < 128) put_byte(n);
+  else { put_byte(0xcf); put_be(n, 8); }
+}
+
+static void put_int(int64_t n)
+{
+  if (n >= -32 && n < 128) put_byte(n);
+  else { put_byte(0xd3); put_be(n, 8); }
+}
+
+static void put_double(double d)
+{
+  uint64_t b;
+  memcpy(&b, &d, sizeof(b));
+  put_byte(0xcb);
+  put_be(b, 8);
+}
+
+// The fields of the schema, in order, with the way to encode each value;
+// variants change the encoding of some of them:
+enum variant {
+  EXACT,
+  FLOAT32,      // ratio as a float32
+  STR8_KEY,     // key of id as a str8
+  BIN_HOST,     // host as a bin, so not found
+  WIDE_INT,     // delta as an int16 instead of a fixint
+};
+
+#define NB_FIELDS 17
+
+static void put_field(unsigned f, enum variant v)
+{
+  static char const *const keys[NB_FIELDS] = {
+    "id", "delta", "ok", "ratio", "host", "blob", "a-b", "a_b", "A", "a",
+    "int", "present", "all", "2x", "k15", "k16",
+    "a_rather_long_key_name_of_more_than_32_chars",
+  };
+  if (f == 0 && v == STR8_KEY) {
+    put_byte(0xd9); put_byte(2); put("id", 2);
+  } else {
+    put_str(keys[f]);
+  }
+  switch (f) {
+    case 0: put_uint(1234567890123ULL); break;
+    case 1:
+      if (v == WIDE_INT) { put_byte(0xd1); put_be((uint16_t)-5, 2); }
+      else put_int(-5);
+      break;
+    case 2: put_byte(0xc3); break;
+    case 3:
+      if (v == FLOAT32) { put_byte(0xca); put_be(0x3fc00000, 4); }  // 1.5
+      else put_double(1.5);
+      break;
+    case 4:
+      if (v == BIN_HOST) { put_byte(0xc4); put_byte(3); put("web", 3); }
+      else put_str("web");
+      break;
+    case 5: put_byte(0xc5); put_be(3, 2); put("\x00\x01\xff", 3); break;
+    case 6: put_int(-1); break;
+    case 7: put_int(-2); break;
+    case 8: put_int(3); break;
+    case 9: put_int(INT64_MIN); break;
+    case 10: put_uint(UINT64_MAX); break;
+    case 11: put_byte(0xc2); break;
+    case 12: put_uint(12); break;
+    case 13: put_str("two"); break;
+    case 14: put_uint(15); break;
+    case 15: put_uint(16); break;
+    case 16: put_str("a value that is also longer than 32 chars"); break;
+  }
+}
+
+static void put_map_header(unsigned n, bool map32)
+{
+  if (map32) { put_byte(0xdf); put_be(n, 4); }
+  else if (n < 16) put_byte(0x80 | n);
+  else { put_byte(0xde); put_be(n, 2); }
+}
+
+/*
+ * Comparing both decoders
+ */
+
+static bool same_data(struct mpgen_data a, struct mpgen_data b)
+{
+  return a.ptr == b.ptr && a.len == b.len;
+}
+
+// Members of fields that were not found are left as they were, and the fast
+// path may have set some before falling back, so only found ones compare:
+static bool same_rec(struct rec const *a, struct rec const *b)
+{
+  if (a->present != b->present) return false;
+# define SAME(flag, cond) (! (a->present & rec_HAS_##flag) || (cond))
+  return
+    SAME(ID, a->id == b->id) &&
+    SAME(DELTA, a->delta == b->delta) &&
+    SAME(OK, a->ok == b->ok) &&
+    SAME(RATIO, a->ratio == b->ratio) &&
+    SAME(HOST, same_data(a->host, b->host)) &&
+    SAME(BLOB, same_data(a->blob, b->blob)) &&
+    SAME(A_B, a->a_b == b->a_b) &&
+    SAME(A_B_2, a->a_b_2 == b->a_b_2) &&
+    SAME(A, a->A == b->A) &&
+    SAME(A_2, a->a_2 == b->a_2) &&
+    SAME(INT_2, a->int_2 == b->int_2) &&
+    SAME(PRESENT_2, a->present_2 == b->present_2) &&
+    SAME(ALL_2, a->all_2 == b->all_2) &&
+    SAME(_2X, same_data(a->_2x, b->_2x)) &&
+    SAME(K15, a->k15 == b->k15) &&
+    SAME(K16, a->k16 == b->k16) &&
+    SAME(A_RATHER_LONG_KEY_NAME_OF_MORE_THAN_32_CHARS,
+         same_data(a->a_rather_long_key_name_of_more_than_32_chars,
+                   b->a_rather_long_key_name_of_more_than_32_chars));
+# undef SAME
+}
+
+static bool data_is(struct mpgen_data d, char const *s)
+{
+  return d.len == strlen(s) && 0 == memcmp(d.ptr, s, d.len);
+}
+
+// Decode buf both ways, check they agree and return what was found:
+static struct rec decode_both(char const *what, size_t expected_size)
+{
+  struct rec fast, generic;
+  memset(&fast, 0x55, sizeof(fast));
+  memset(&generic, 0xaa, sizeof(generic));
+  size_t const fast_size = rec_decode(buf, len, &fast);
+  size_t const generic_size = rec_decode_generic(buf, len, &generic);
+  if (fast_size != expected_size || generic_size != expected_size) {
+    fprintf(stderr, "%s: decoded %zu and %zu bytes instead of %zu\n",
+            what, fast_size, generic_size, expected_size);
+    nb_failures ++;
+  } else if (expected_size > 0 && ! same_rec(&fast, &generic)) {
+    fprintf(stderr, "%s: rec_decode and rec_decode_generic disagree\n", what);
+    nb_failures ++;
+  }
+  return generic;
+}
+
+static void check_values(struct rec const *r)
+{
+  CHECK(r->id == 1234567890123ULL);
+  CHECK(r->delta == -5);
+  CHECK(r->ok);
+  CHECK(r->ratio == 1.5);
+  CHECK(r->blob.len == 3 && 0 == memcmp(r->blob.ptr, "\x00\x01\xff", 3));
+  CHECK(r->a_b == -1 && r->a_b_2 == -2);
+  CHECK(r->A == 3 && r->a_2 == INT64_MIN);
+  CHECK(r->int_2 == UINT64_MAX);
+  CHECK(! r->present_2);
+  CHECK(r->all_2 == 12);
+  CHECK(data_is(r->_2x, "two"));
+  CHECK(r->k15 == 15 && r->k16 == 16);
+  CHECK(data_is(r->a_rather_long_key_name_of_more_than_32_chars,
+                "a value that is also longer than 32 chars"));
+}
+
+static void check_record(char const *what, enum variant v, bool map32, uint64_t expected_present)
+{
+  len = 0;
+  put_map_header(NB_FIELDS, map32);
+  for (unsigned f = 0; f < NB_FIELDS; f++) put_field(f, v);
+  struct rec const r = decode_both(what, len);
+  CHECK(r.present == expected_present);
+  if (v != BIN_HOST) CHECK(data_is(r.host, "web"));
+  check_values(&r);
+}
+
+static void check_records(void)
+{
+  check_record("exact", EXACT, false, rec_HAS_ALL);
+  check_record("float32", FLOAT32, false, rec_HAS_ALL);
+  check_record("str8 key", STR8_KEY, false, rec_HAS_ALL);
+  check_record("wide int", WIDE_INT, false, rec_HAS_ALL);
+  check_record("map32", EXACT, true, rec_HAS_ALL);
+  check_record("bin host", BIN_HOST, false, rec_HAS_ALL & ~rec_HAS_HOST);
+
+  // Reversed key order:
+  len = 0;
+  put_map_header(NB_FIELDS, false);
+  for (unsigned f = NB_FIELDS; f-- > 0; ) put_field(f, EXACT);
+  struct rec r = decode_both("reversed", len);
+  CHECK(r.present == rec_HAS_ALL);
+  check_values(&r);
+
+  // Missing fields (ok and k16):
+  len = 0;
+  put_map_header(NB_FIELDS - 2, false);
+  for (unsigned f = 0; f < NB_FIELDS; f++) {
+    if (f != 2 && f != 15) put_field(f, EXACT);
+  }
+  r = decode_both("missing", len);
+  CHECK(r.present == (rec_HAS_ALL & ~(rec_HAS_OK | rec_HAS_K16)));
+
+  // Extra keys, one a str and one a non str, in the middle:
+  len = 0;
+  put_map_header(NB_FIELDS + 2, false);
+  for (unsigned f = 0; f < NB_FIELDS; f++) {
+    if (f == 5) {
+      put_str("extra"); put_byte(0x92); put_byte(0xc0); put_str("x");
+      put_byte(0x91); put_byte(0x01); put_byte(0x81); put_str("k"); put_byte(0xc0);
+    }
+    put_field(f, EXACT);
+  }
+  r = decode_both("extra", len);
+  CHECK(r.present == rec_HAS_ALL);
+  check_values(&r);
+
+  // Followed by another value, which is not part of the record:
+  check_record("exact", EXACT, false, rec_HAS_ALL);
+  size_t const rec_len = len;
+  put_byte(0xc0);
+  decode_both("followed", rec_len);
+
+  // Truncated anywhere:
+  check_record("exact", EXACT, false, rec_HAS_ALL);
+  size_t const full = len;
+  for (len = 0; len < full; len++) {
+    char what[40];
+    snprintf(what, sizeof(what), "truncated to %zu", len);
+    decode_both(what, 0);
+  }
+
+  // Not a map:
+  len = 0;
+  put_byte(0x91); put_byte(0x01);
+  decode_both("array", 0);
+}
+
+int main(void)
+{
+  check_records();
+  if (nb_failures > 0) {
+    fprintf(stderr, "%u checks failed\n", nb_failures);
+    return 1;
+  }
+  printf("msgpack-codegen ok\n");
+  return 0;
+}
@@ -0,0 +1,194 @@
+/*
+ * Checks that msgpack-decode.hpp decodes like msgpack-dump does.
+ *
+ * Each file is decoded with a visitor printing the same notation as
+ * `msgpack-dump --mode compact`, and the result is compared with the output
+ * of the given msgpack-dump. A built-in sample holding every tag is checked
+ * first, then the given files (the benchmark corpus, typically).
+ *
+ * Not covered: strings that are not valid UTF-8 and timestamp extensions,
+ * which msgpack-dump reformats rather than prints as they are.
+ */
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "../msgpack-decode.hpp"
+
+using namespace msgpack_dump;
+
+namespace {
+
+class compact_printer : public visitor {
+  std::string &out_;
+  // Number of items printed so far in each enclosing container, and whether
+  // it is a map:
+  std::vector<std::pair<std::uint64_t, bool>> stack_;
+
+  void sep()
+  {
+    if (stack_.empty()) return;
+    auto &[n, is_map] = stack_.back();
+    if (n > 0) out_ += is_map && n % 2 ? ": " : ", ";
+    n ++;
+  }
+
+  void hex(std::string_view s)
+  {
+    static char const digits[] = "0123456789abcdef";
+    for (std::size_t i = 0; i < s.size(); i++) {
+      if (i > 0) out_ += ' ';
+      out_ += digits[(unsigned char)s[i] >> 4];
+      out_ += digits[(unsigned char)s[i] & 15];
+    }
+  }
+
+  void number(char const *fmt, ...) __attribute__((format(printf, 2, 3)))
+  {
+    char buf[32];
+    va_list ap;
+    va_start(ap, fmt);
+    int const len = std::vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    out_.append(buf, len);
+  }
+
+public:
+  explicit compact_printer(std::string &out) : out_(out) {}
+
+  void nil() { sep(); out_ += "()"; }
+  void boolean(bool b) { sep(); out_ += b ? "true" : "false"; }
+  void integer(std::int64_t n) { sep(); number("%lld", (long long)n); }
+  void uinteger(std::uint64_t n) { sep(); number("%llu", (unsigned long long)n); }
+  void floating(double v) { sep(); number("%g", v); }
+  void str(std::string_view s) { sep(); out_ += '"'; out_ += s; out_ += '"'; }
+  void bin(std::string_view s) { sep(); hex(s); }
+  void ext(std::int8_t type, std::string_view s) { sep(); number("Type%d:", type); hex(s); }
+  void array_begin(std::uint32_t) { sep(); out_ += '['; stack_.push_back({ 0, false }); }
+  void array_end() { stack_.pop_back(); out_ += ']'; }
+  void map_begin(std::uint32_t) { sep(); out_ += '{'; stack_.push_back({ 0, true }); }
+  void map_end() { stack_.pop_back(); out_ += '}'; }
+};
+
+// One value per tag, some with longer length fields than needed:
+unsigned char const sample[] = {
+  0xc0, 0xc2, 0xc3, 0x00, 0x7f, 0xe0, 0xff,
+  0xcc, 0xff, 0xcd, 0x12, 0x34, 0xce, 0x12, 0x34, 0x56, 0x78,
+  0xcf, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xd0, 0x80, 0xd1, 0x80, 0x00, 0xd2, 0x80, 0x00, 0x00, 0x00,
+  0xd3, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xca, 0x3f, 0xc0, 0x00, 0x00, 0xcb, 0x40, 0x09, 0x21, 0xfb, 0x54, 0x44, 0x2d, 0x18,
+  0xa0, 0xa3, 'a', 0xc3, 0xa9, 0xd9, 0x01, 'b', 0xda, 0x00, 0x01, 'c',
+  0xdb, 0x00, 0x00, 0x00, 0x02, '\\', '\n',
+  0xc4, 0x00, 0xc4, 0x02, 0x01, 0x02, 0xc5, 0x00, 0x01, 0xab,
+  0xc6, 0x00, 0x00, 0x00, 0x03, 0x00, 0x80, 0xff,
+  0xd4, 0x05, 0x01, 0xd5, 0x7f, 0x01, 0x02, 0xd6, 0x80, 0x01, 0x02, 0x03, 0x04,
+  0xd7, 0x05, 0, 1, 2, 3, 4, 5, 6, 7,
+  0xd8, 0x05, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+  0xc7, 0x00, 0x05, 0xc8, 0x00, 0x01, 0x05, 0xaa, 0xc9, 0x00, 0x00, 0x00, 0x01, 0x05, 0xbb,
+  0x90, 0x80, 0x93, 0x01, 0xcd, 0x01, 0x00, 0xa1, 'x',
+  0xdc, 0x00, 0x02, 0xcb, 0x3f, 0xf8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc0,
+  0xdd, 0x00, 0x00, 0x00, 0x01, 0x91, 0x80,
+  0x82, 0xa1, 'k', 0x01, 0x02, 0x92, 0xc2, 0xc3,
+  0xde, 0x00, 0x01, 0xa1, 'm', 0xdf, 0x00, 0x00, 0x00, 0x01, 0xc0, 0x90,
+};
+
+bool read_file(char const *fname, std::vector<unsigned char> &buf)
+{
+  std::FILE *f = std::fopen(fname, "rb");
+  if (! f) {
+    std::fprintf(stderr, "Cannot open '%s': %s\n", fname, std::strerror(errno));
+    return false;
+  }
+  unsigned char chunk[65536];
+  std::size_t n;
+  while (0 < (n = std::fread(chunk, 1, sizeof(chunk), f))) buf.insert(buf.end(), chunk, chunk + n);
+  bool const ok = ! std::ferror(f);
+  std::fclose(f);
+  if (! ok) std::fprintf(stderr, "Cannot read '%s'\n", fname);
+  return ok;
+}
+
+bool run_dump(char const *prog, char const *fname, std::string &out)
+{
+  std::string const cmd = std::string("'") + prog + "' -m compact '" + fname + "'";
+  std::FILE *p = popen(cmd.c_str(), "r");
+  if (! p) {
+    std::fprintf(stderr, "Cannot run %s: %s\n", cmd.c_str(), std::strerror(errno));
+    return false;
+  }
+  char chunk[65536];
+  std::size_t n;
+  while (0 < (n = std::fread(chunk, 1, sizeof(chunk), p))) out.append(chunk, n);
+  if (0 != pclose(p)) {
+    std::fprintf(stderr, "%s failed\n", cmd.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool check(char const *prog, char const *fname)
+{
+  std::vector<unsigned char> buf;
+  if (! read_file(fname, buf)) return false;
+
+  std::string expected, got;
+  if (! run_dump(prog, fname, expected)) return false;
+
+  compact_printer printer(got);
+  span<std::byte const> in(reinterpret_cast<std::byte const *>(buf.data()), buf.size());
+  while (in.size() > 0) {
+    result const res = decode(in, printer);
+    if (! res) {
+      std::fprintf(stderr, "%s: cannot decode at offset %zu\n",
+                   fname, std::size_t(in.data() - reinterpret_cast<std::byte const *>(buf.data())));
+      return false;
+    }
+    got += '\n';
+    in = in.subspan(res.consumed);
+  }
+
+  if (got != expected) {
+    std::size_t off = 0;
+    while (off < got.size() && off < expected.size() && got[off] == expected[off]) off++;
+    std::size_t const col = off - (off > 0 ? got.rfind('\n', off - 1) + 1 : 0);
+    std::fprintf(stderr, "%s: output differs at byte %zu (column %zu)\n", fname, off, col);
+    return false;
+  }
+  std::printf("%-32s ok\n", fname);
+  return true;
+}
+
+bool check_sample(char const *prog)
+{
+  char fname[] = "/tmp/check-decode.XXXXXX";
+  int const fd = mkstemp(fname);
+  if (fd < 0) {
+    std::fprintf(stderr, "Cannot create a temporary file: %s\n", std::strerror(errno));
+    return false;
+  }
+  bool ok = sizeof(sample) == write(fd, sample, sizeof(sample));
+  if (! ok) std::fprintf(stderr, "Cannot write '%s': %s\n", fname, std::strerror(errno));
+  close(fd);
+  ok = ok && check(prog, fname);
+  unlink(fname);
+  return ok;
+}
+
+}  // namespace
+
+int main(int nb_args, char **args)
+{
+  if (nb_args < 2) {
+    std::fprintf(stderr, "%s msgpack-dump [file...]\n", args[0]);
+    return 1;
+  }
+
+  bool ok = check_sample(args[1]);
+  for (int a = 2; a < nb_args; a++) ok = check(args[1], args[a]) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,153 @@
+/*
+ * Checks msgpack-lazy.hpp on hand written values: lookups by key and
+ * index, malformed input, and cached_map in and out of scan order,
+ * including once its table is full.
+ */
+#include <cstdio>
+#include <string_view>
+#include <vector>
+#include "../msgpack-lazy.hpp"
+
+using namespace msgpack_dump;
+
+namespace {
+
+unsigned nb_failures;
+
+#define CHECK(cond) do { \
+  if (! (cond)) { \
+    std::fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+    nb_failures ++; \
+  } \
+} while (0)
+
+using bytes = std::vector<unsigned char>;
+
+value value_of(bytes const &b)
+{
+  return value(span<std::byte const>(reinterpret_cast<std::byte const *>(b.data()), b.size()));
+}
+
+// {"a": 1, "meta": {"id": -42, "name": "bob"}, "list": [1, 2.5, "x"], "z": nil}
+bytes const rec = {
+  0x84,
+  0xa1, 'a', 0x01,
+  0xa4, 'm', 'e', 't', 'a', 0x82,
+    0xa2, 'i', 'd', 0xd0, 0xd6,
+    0xa4, 'n', 'a', 'm', 'e', 0xa3, 'b', 'o', 'b',
+  0xa4, 'l', 'i', 's', 't', 0x93,
+    0x01, 0xcb, 0x40, 0x04, 0, 0, 0, 0, 0, 0, 0xa1, 'x',
+  0xa1, 'z', 0xc0,
+};
+
+void check_lookups()
+{
+  value const v = value_of(rec);
+  CHECK(v.type() == kind::map);
+  CHECK(v.size() == 4);
+  CHECK(v["a"].as_int() == 1);
+  CHECK(v["meta"]["id"].as_int() == -42);
+  CHECK(v["meta"]["name"].as_str() == std::string_view("bob"));
+  CHECK(v["z"].is_nil());
+  CHECK(v["list"][0].as_uint() == 1u);
+  CHECK(v["list"][1].as_double() == 2.5);
+  CHECK(v["list"][2].as_str() == std::string_view("x"));
+  CHECK(v.bytes().size() == rec.size());
+
+  // Missing keys, out of range indices and wrong types:
+  CHECK(! v["nope"]);
+  CHECK(! v["meta"]["nope"]["deeper"]);
+  CHECK(! v["list"][3]);
+  CHECK(! v["a"][0]);
+  CHECK(! v[0]);
+  CHECK(! v["a"].as_str());
+  CHECK(! v["nope"].as_int());
+}
+
+void check_malformed()
+{
+  // Truncated in the middle of the value of "b":
+  bytes const trunc = { 0x82, 0xa1, 'a', 0x01, 0xa1, 'b', 0xa5, 'x', 'y' };
+  value const t = value_of(trunc);
+  CHECK(t["a"].as_int() == 1);
+  CHECK(! t["b"].as_str());
+  CHECK(! t["c"]);
+  CHECK(t.bytes().size() == 0);
+  CHECK(! t.next());
+
+  // Array announcing more items than there are:
+  bytes const short_array = { 0x93, 0x01 };
+  CHECK(value_of(short_array)[0].as_int() == 1);
+  CHECK(! value_of(short_array)[1]);
+  CHECK(! value_of(short_array)[2]);
+
+  // Map ending after a key:
+  bytes const no_value = { 0x81, 0xa1, 'a' };
+  CHECK(! value_of(no_value)["a"]);
+  CHECK(! cached_map<>(value_of(no_value))["a"]);
+
+  // Bad tag, missing length field, empty buffer:
+  CHECK(value_of(bytes { 0xc1 }).type() == kind::bad);
+  CHECK(! value_of(bytes { 0xcd, 0x01 }).as_uint());
+  CHECK(! value_of(bytes { 0xda, 0x00 }).as_str());
+  CHECK(value_of(bytes {}).type() == kind::bad);
+  CHECK(! value()["a"]);
+}
+
+void check_cached_map()
+{
+  value const v = value_of(rec);
+
+  // Out of scan order, then back:
+  cached_map<> m(v);
+  CHECK(m["z"].is_nil());
+  CHECK(m["a"].as_int() == 1);
+  CHECK(m["meta"]["name"].as_str() == std::string_view("bob"));
+  CHECK(m["list"][2].as_str() == std::string_view("x"));
+  CHECK(! m["nope"]);
+  CHECK(m["z"].is_nil());
+
+  // In scan order:
+  cached_map<> m2(v);
+  CHECK(m2["a"].as_int() == 1);
+  CHECK(m2["meta"]["id"].as_int() == -42);
+  CHECK(m2["list"].size() == 3);
+  CHECK(m2["z"].is_nil());
+  CHECK(! m2["nope"]);
+
+  // Only one slot is usable with N = 2, so after scanning the whole map
+  // the other keys are found by the linear fallback:
+  cached_map<2> small(v);
+  CHECK(small["z"].is_nil());
+  CHECK(small["meta"]["id"].as_int() == -42);
+  CHECK(small["list"][1].as_double() == 2.5);
+  CHECK(small["a"].as_int() == 1);
+  CHECK(! small["nope"]);
+
+  // Keys before a malformed item are found; nothing from it on is:
+  bytes const trunc = { 0x83, 0xa1, 'a', 0x01, 0xa1, 'b', 0xa5, 'x', 'y' };
+  cached_map<> t(value_of(trunc));
+  CHECK(t["a"].as_int() == 1);
+  CHECK(! t["b"]);
+  CHECK(! t["c"]);
+  CHECK(t["a"].as_int() == 1);
+
+  // Not a map:
+  cached_map<> a(v["list"]);
+  CHECK(! a["a"]);
+}
+
+}  // namespace
+
+int main()
+{
+  check_lookups();
+  check_malformed();
+  check_cached_map();
+  if (nb_failures > 0) {
+    std::fprintf(stderr, "%u checks failed\n", nb_failures);
+    return 1;
+  }
+  std::printf("msgpack-lazy.hpp ok\n");
+  return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Checks that the SIMD versions of msgpack-dump's kernels (hex_kernel,
+ * json_scan, bswap_run and utf8_check) give the same results as the scalar
+ * ones.
+ *
+ * msgpack-dump.c is included as is (its main renamed), as in bench/micro.c.
+ * Every level from sse4.2 up to the one simd_ctor() selects is checked, so
+ * MSGPACK_DUMP_SIMD limits the check to the lower levels.
+ *
+ * Inputs are random, of every length up to LEN_MAX so that all tails after
+ * whole blocks are covered, with bytes above 0x7f, and for json_scan and
+ * utf8_check with a char to escape or an invalid UTF-8 sequence at every
+ * position.
+ */
+#define main msgpack_dump_main
+#include "../msgpack-dump.c"
+#undef main
+
+// A block of the widest kernels, and every tail after it:
+#define LEN_MAX (64 + 64)
+#define GUARD 16
+
+static unsigned nb_failures;
+
+static void failed(char const *kernel, size_t len, size_t pos, unsigned char const *p, size_t p_len)
+{
+  if (nb_failures++ >= 20) return;
+  fprintf(stderr, "%s at %s differs from scalar, len %zu, pos %zu:", kernel, simd_names[simd_level], len, pos);
+  for (size_t i = 0; i < p_len && i < 64; i++) fprintf(stderr, " %02x", p[i]);
+  fprintf(stderr, "%s\n", p_len > 64 ? "..." : "");
+}
+
+// xorshift64, with a fixed seed so that failures can be reproduced:
+static uint64_t rnd_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rnd(void)
+{
+  rnd_state ^= rnd_state << 13;
+  rnd_state ^= rnd_state >> 7;
+  rnd_state ^= rnd_state << 17;
+  return rnd_state;
+}
+
+static void rnd_bytes(unsigned char *p, size_t len)
+{
+  for (size_t i = 0; i < len; i++) p[i] = rnd();
+}
+
+/*
+ * Kernels
+ */
+
+static void check_hex(void)
+{
+  unsigned char src[LEN_MAX];
+  char exp[2*LEN_MAX + GUARD], got[2*LEN_MAX + GUARD];
+  for (size_t len = 0; len <= LEN_MAX; len++) {
+    rnd_bytes(src, len);
+    memset(exp, '!', sizeof(exp));
+    memset(got, '!', sizeof(got));
+    hex_scalar(exp, src, len);
+    hex_kernel(got, src, len);
+    // Nothing must be written past the 2*len digits either:
+    if (0 != memcmp(exp, got, sizeof(exp))) failed("hex", len, 0, src, len);
+  }
+}
+
+// Printable chars, and some above 0x7f that must not be taken for controls:
+static void json_plain(unsigned char *p, size_t len)
+{
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c;
+    do c = 0x20 + rnd() % 0xe0; while (c == '"' || c == '\\');
+    p[i] = c;
+  }
+}
+
+static void check_json_scan(void)
+{
+  static unsigned char const escaped[] = { 0x00, 0x01, 0x0a, 0x1f, '"', '\\' };
+  unsigned char buf[LEN_MAX];
+  for (size_t len = 0; len <= LEN_MAX; len++) {
+    json_plain(buf, len);
+    if (json_scan_scalar(buf, len) != json_scan(buf, len)) failed("json_scan", len, len, buf, len);
+    for (size_t pos = 0; pos < len; pos++) {
+      unsigned char const c = buf[pos];
+      buf[pos] = escaped[rnd() % sizeof(escaped)];
+      if (json_scan_scalar(buf, len) != json_scan(buf, len)) failed("json_scan", len, pos, buf, len);
+      buf[pos] = c;
+    }
+    // Anything at all:
+    rnd_bytes(buf, len);
+    if (json_scan_scalar(buf, len) != json_scan(buf, len)) failed("json_scan", len, 0, buf, len);
+  }
+}
+
+static void check_bswap_run(void)
+{
+  static size_t const widths[] = { 2, 4, 8 };
+  uint64_t exp[LEN_MAX + GUARD], got[LEN_MAX + GUARD];
+  for (unsigned w = 0; w < sizeof(widths)/sizeof(widths[0]); w++) {
+    size_t const width = widths[w];
+    uint64_t const mask = width == 8 ? ~0ULL : (1ULL << (width * 8)) - 1;
+    for (size_t nb = 0; nb <= LEN_MAX; nb++) {
+      for (size_t i = 0; i < LEN_MAX + GUARD; i++) exp[i] = got[i] = rnd() & mask;
+      bswap_run_scalar(exp, nb, width);
+      bswap_run(got, nb, width);
+      if (0 != memcmp(exp, got, sizeof(exp))) {
+        char name[16];
+        snprintf(name, sizeof(name), "bswap_run/%zu", width);
+        failed(name, nb, 0, (unsigned char const *)got, nb * 8);
+      }
+    }
+  }
+}
+
+// Random valid UTF-8, of exactly len bytes:
+static void utf8_valid(unsigned char *p, size_t len)
+{
+  size_t n = 0;
+  while (n < len) {
+    size_t const left = len - n;
+    unsigned const kind = rnd() % 8;
+    uint32_t cp;
+    if (kind < 3 || left < 2) {
+      p[n++] = rnd() % 0x80;
+    } else if (kind < 5 || left < 3) {
+      cp = 0x80 + rnd() % (0x800 - 0x80);
+      p[n++] = 0xc0 | cp >> 6;
+      p[n++] = 0x80 | (cp & 0x3f);
+    } else if (kind < 7 || left < 4) {
+      do cp = 0x800 + rnd() % (0x10000 - 0x800); while (cp >= 0xd800 && cp < 0xe000);
+      p[n++] = 0xe0 | cp >> 12;
+      p[n++] = 0x80 | (cp >> 6 & 0x3f);
+      p[n++] = 0x80 | (cp & 0x3f);
+    } else {
+      cp = 0x10000 + rnd() % (0x110000 - 0x10000);
+      p[n++] = 0xf0 | cp >> 18;
+      p[n++] = 0x80 | (cp >> 12 & 0x3f);
+      p[n++] = 0x80 | (cp >> 6 & 0x3f);
+      p[n++] = 0x80 | (cp & 0x3f);
+    }
+  }
+}
+
+static void check_utf8(unsigned char const *p, size_t len, size_t pos)
+{
+  if (utf8_check_scalar(p, len) != utf8_check(p, len)) failed("utf8_check", len, pos, p, len);
+}
+
+static void check_utf8_check(void)
+{
+  // Bad on their own, or when they end the string or interrupt a sequence:
+  static struct { unsigned char b[4]; size_t len; } const bad[] = {
+    { { 0x80 }, 1 }, { { 0xbf }, 1 }, { { 0xc0, 0x80 }, 2 }, { { 0xc1, 0xbf }, 2 },
+    { { 0xc2 }, 1 }, { { 0xe2, 0x82 }, 2 }, { { 0xf0, 0x9f, 0x98 }, 3 },
+    { { 0xe0, 0x80, 0x80 }, 3 }, { { 0xed, 0xa0, 0x80 }, 3 }, { { 0xf0, 0x80, 0x80, 0x80 }, 4 },
+    { { 0xf4, 0x90, 0x80, 0x80 }, 4 }, { { 0xf5, 0x80, 0x80, 0x80 }, 4 }, { { 0xff }, 1 },
+  };
+  unsigned char ascii[LEN_MAX], mixed[LEN_MAX], buf[LEN_MAX];
+  for (size_t i = 0; i < LEN_MAX; i++) ascii[i] = 'a' + i % 26;
+  for (size_t len = 0; len <= LEN_MAX; len++) {
+    utf8_valid(mixed, len);
+    check_utf8(ascii, len, len);
+    check_utf8(mixed, len, len);
+    for (size_t pos = 0; pos < len; pos++) {
+      for (unsigned b = 0; b < sizeof(bad)/sizeof(bad[0]); b++) {
+        size_t const l = pos + bad[b].len <= len ? bad[b].len : len - pos;
+        memcpy(buf, ascii, len);
+        memcpy(buf + pos, bad[b].b, l);
+        check_utf8(buf, len, pos);
+        memcpy(buf, mixed, len);
+        memcpy(buf + pos, bad[b].b, l);
+        check_utf8(buf, len, pos);
+      }
+    }
+    // Anything at all, mostly invalid:
+    rnd_bytes(buf, len);
+    check_utf8(buf, len, 0);
+  }
+}
+
+int main(void)
+{
+  simd_ctor();
+  enum simd_level const top = simd_level;
+  if (top == SIMD_SCALAR) {
+    printf("No SIMD level to check against scalar\n");
+    return 0;
+  }
+  for (enum simd_level l = SIMD_SSE42; l <= top; l++) {
+    simd_bind(l);
+    unsigned const before = nb_failures;
+    check_hex();
+    check_json_scan();
+    check_bswap_run();
+    check_utf8_check();
+    printf("%-8s %s\n", simd_names[l], nb_failures == before ? "ok" : "FAILED");
+  }
+  return nb_failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,277 @@
+/*
+ * Compares msgpack-dump's decoder with other msgpack decoders on the
+ * benchmark corpus: throughput, number and size of heap allocations, and
+ * peak RSS.
+ *
+ * Only decoding is compared: msgpack-dump runs in a mode that reads every
+ * str, bin and ext payload into its arena, as the printing modes do, but
+ * prints nothing (null mode would skip payloads), and msgpack-c's unpacker
+ * builds its objects and drops them. msgpack-c is only compared if it was
+ * found at build time (HAVE_MSGPACK_C).
+ *
+ * Allocations are counted by replacing malloc and friends in this
+ * executable, which also catches those made from within shared libraries.
+ * The arena of msgpack-dump takes its blocks from mmap, which is replaced
+ * too and counted apart. Each decoder runs in its own process so that its
+ * peak RSS can be told apart.
+ */
+#define main msgpack_dump_main
+#include "../msgpack-dump.c"
+#undef main
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#ifdef HAVE_MSGPACK_C
+# include <msgpack.h>
+#endif
+
+/*
+ * Allocation counters
+ */
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static uint64_t nb_allocs, alloc_bytes;
+
+void *malloc(size_t sz)
+{
+  nb_allocs ++;
+  alloc_bytes += sz;
+  return __libc_malloc(sz);
+}
+
+void *calloc(size_t nb, size_t sz)
+{
+  nb_allocs ++;
+  alloc_bytes += nb * sz;
+  return __libc_calloc(nb, sz);
+}
+
+void *realloc(void *ptr, size_t sz)
+{
+  nb_allocs ++;
+  alloc_bytes += sz;
+  return __libc_realloc(ptr, sz);
+}
+
+void free(void *ptr)
+{
+  __libc_free(ptr);
+}
+
+// Only calls from this executable end up here; the C library maps memory
+// for malloc on its own, which is counted above already:
+static uint64_t nb_maps, map_bytes;
+
+void *mmap(void *addr, size_t sz, int prot, int flags, int fd, off_t off)
+{
+  nb_maps ++;
+  map_bytes += sz;
+  return (void *)syscall(SYS_mmap, addr, sz, prot, flags, fd, off);
+}
+
+/*
+ * Decode mode: the null emitters, but with payloads read
+ */
+
+static bool const decode_skip_data = false;
+
+#define decode_emit_start null_emit_start
+#define decode_emit_stop null_emit_stop
+#define decode_emit_nil null_emit_nil
+#define decode_emit_bool null_emit_bool
+#define decode_emit_fixint null_emit_fixint
+#define decode_emit_int null_emit_int
+#define decode_emit_uint null_emit_uint
+#define decode_emit_float null_emit_float
+#define decode_emit_str null_emit_str
+#define decode_emit_bin null_emit_bin
+#define decode_emit_ext null_emit_ext
+#define decode_emit_array_open null_emit_array_open
+#define decode_emit_array_close null_emit_array_close
+#define decode_emit_map_open null_emit_map_open
+#define decode_emit_map_item null_emit_map_item
+#define decode_emit_map_close null_emit_map_close
+#define decode_emit_num_array_open null_emit_num_array_open
+#define decode_emit_num_run null_emit_num_run
+#define decode_emit_inline_sep null_emit_inline_sep
+#define decode_emit_num_array_close null_emit_num_array_close
+#define decode_emit_num_array_break null_emit_num_array_break
+
+#define MODE decode
+#include "../dump-loop.h"
+
+/*
+ * Decoders
+ *
+ * Each decodes the whole file and returns the number of top level values,
+ * or -1 on error.
+ */
+
+static int64_t decode_msgpack_dump(int fd)
+{
+  struct ctx ctx;
+  if (! ctx_ctor(&ctx, fd)) return -1;
+  int64_t nb = 0;
+  while (true) {
+    if (! decode_dump(&ctx, ROLE_NONE)) {
+      nb = -1;
+      break;
+    }
+    if (ctx.eof) break;
+    nb ++;
+    arena_reset(&arena);
+  }
+  arena_dtor(&arena);
+  ctx_dtor(&ctx);
+  return nb;
+}
+
+#ifdef HAVE_MSGPACK_C
+static int64_t decode_msgpack_c(int fd)
+{
+  msgpack_unpacker unp;
+  if (! msgpack_unpacker_init(&unp, MSGPACK_UNPACKER_INIT_BUFFER_SIZE)) return -1;
+  msgpack_unpacked result;
+  msgpack_unpacked_init(&result);
+
+  int64_t nb = 0;
+  while (nb >= 0) {
+    if (! msgpack_unpacker_reserve_buffer(&unp, IBUF_SIZE)) {
+      nb = -1;
+      break;
+    }
+    ssize_t const ret = read(fd, msgpack_unpacker_buffer(&unp), msgpack_unpacker_buffer_capacity(&unp));
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) {
+      if (ret < 0) nb = -1;
+      break;
+    }
+    msgpack_unpacker_buffer_consumed(&unp, ret);
+
+    msgpack_unpack_return r;
+    while (MSGPACK_UNPACK_SUCCESS == (r = msgpack_unpacker_next(&unp, &result))) nb ++;
+    if (r == MSGPACK_UNPACK_PARSE_ERROR || r == MSGPACK_UNPACK_NOMEM_ERROR) nb = -1;
+  }
+
+  msgpack_unpacked_destroy(&result);
+  msgpack_unpacker_destroy(&unp);
+  return nb;
+}
+#endif
+
+static struct decoder {
+  char const *name;
+  int64_t (*decode)(int fd);
+} const decoders[] = {
+  { "msgpack-dump", decode_msgpack_dump },
+#ifdef HAVE_MSGPACK_C
+  { "msgpack-c", decode_msgpack_c },
+#endif
+};
+
+#define NB_DECODERS (sizeof(decoders)/sizeof(decoders[0]))
+
+static char const *const corpora[] = {
+  "small-ints", "float-arrays", "wide-maps", "deep-nesting", "large-bins", "log-records",
+};
+
+// What a decoding process reports:
+struct run {
+  int64_t nb_records;
+  double duration;
+  uint64_t nb_allocs, alloc_bytes;
+  uint64_t nb_maps, map_bytes;
+  long maxrss;  // KiB, filled by the parent
+};
+
+static bool run_decoder(struct decoder const *d, char const *fname, struct run *run)
+{
+  int fds[2];
+  if (0 != pipe(fds)) {
+    fprintf(stderr, "Cannot pipe: %s\n", strerror(errno));
+    return false;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Cannot fork: %s\n", strerror(errno));
+    return false;
+  }
+
+  if (pid == 0) {
+    close(fds[0]);
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "Cannot open '%s': %s\n", fname, strerror(errno));
+      _exit(1);
+    }
+    nb_allocs = alloc_bytes = nb_maps = map_bytes = 0;
+    double const start = now();
+    run->nb_records = d->decode(fd);
+    run->duration = now() - start;
+    run->nb_allocs = nb_allocs;
+    run->alloc_bytes = alloc_bytes;
+    run->nb_maps = nb_maps;
+    run->map_bytes = map_bytes;
+    if (sizeof(*run) != write(fds[1], run, sizeof(*run))) _exit(1);
+    _exit(0);
+  }
+
+  close(fds[1]);
+  bool ok = sizeof(*run) == read(fds[0], run, sizeof(*run));
+  close(fds[0]);
+  int status;
+  struct rusage ru;
+  while (wait4(pid, &status, 0, &ru) < 0) {
+    if (errno != EINTR) {
+      fprintf(stderr, "Cannot wait: %s\n", strerror(errno));
+      return false;
+    }
+  }
+  run->maxrss = ru.ru_maxrss;
+  if (! ok || ! WIFEXITED(status) || WEXITSTATUS(status) != 0 || run->nb_records < 0) {
+    fprintf(stderr, "%s failed to decode %s\n", d->name, fname);
+    return false;
+  }
+  return true;
+}
+
+int main(int nb_args, char **args)
+{
+  char const *dir = nb_args > 1 ? args[1] : "bench/corpus";
+
+# ifndef HAVE_MSGPACK_C
+  printf("msgpack-c was not found at build time, only msgpack-dump is measured.\n\n");
+# endif
+
+  printf("%-14s %-14s %10s %8s %12s %12s %8s %10s %10s\n",
+         "corpus", "decoder", "MB/s", "rel.", "allocs", "alloc MiB", "mmaps", "mmap MiB", "maxrss KiB");
+
+  for (unsigned c = 0; c < sizeof(corpora)/sizeof(corpora[0]); c++) {
+    char fname[4096];
+    snprintf(fname, sizeof(fname), "%s/%s.mp", dir, corpora[c]);
+    struct stat st;
+    if (0 != stat(fname, &st)) {
+      fprintf(stderr, "Cannot stat '%s': %s\n", fname, strerror(errno));
+      return 1;
+    }
+
+    double ref_mbps = 0;
+    for (unsigned d = 0; d < NB_DECODERS; d++) {
+      struct run run;
+      if (! run_decoder(decoders + d, fname, &run)) return 1;
+      double const mbps = st.st_size / run.duration / 1e6;
+      if (d == 0) ref_mbps = mbps;
+      printf("%-14s %-14s %10.2f %7.0f%% %12llu %12.2f %8llu %10.2f %10ld\n",
+             corpora[c], decoders[d].name, mbps, 100. * mbps / ref_mbps,
+             (unsigned long long)run.nb_allocs, run.alloc_bytes / 1048576.,
+             (unsigned long long)run.nb_maps, run.map_bytes / 1048576., run.maxrss);
+      fflush(stdout);
+    }
+  }
+  return 0;
+}
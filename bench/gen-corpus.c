@@ -0,0 +1,306 @@
+/*
+ * Writes the benchmark corpus: one msgpack file per kind of data, of about
+ * the requested size, always the same for a given seed.
+ *
+ * Each NAME.mp comes with a NAME.count file holding its number of top
+ * level values, for the runner to compute records/s.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+/*
+ * Deterministic random numbers (xorshift64*)
+ */
+
+static uint64_t rnd_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rnd(void)
+{
+  rnd_state ^= rnd_state >> 12;
+  rnd_state ^= rnd_state << 25;
+  rnd_state ^= rnd_state >> 27;
+  return rnd_state * 0x2545f4914f6cdd1dULL;
+}
+
+static uint64_t rnd_below(uint64_t n)
+{
+  return rnd() % n;
+}
+
+/*
+ * Packing
+ */
+
+static FILE *out;
+static uint64_t out_bytes;
+
+static void put(void const *data, size_t len)
+{
+  if (len != fwrite(data, 1, len, out)) {
+    fprintf(stderr, "Cannot write: %s\n", strerror(errno));
+    exit(1);
+  }
+  out_bytes += len;
+}
+
+static void put_tag_be(unsigned char tag, uint64_t n, size_t width)
+{
+  unsigned char b[9];
+  b[0] = tag;
+  for (size_t i = 0; i < width; i++) b[1 + i] = n >> (8 * (width - 1 - i));
+  put(b, 1 + width);
+}
+
+static void pack_nil(void)
+{
+  put("\xc0", 1);
+}
+
+static void pack_bool(bool b)
+{
+  put(b ? "\xc3" : "\xc2", 1);
+}
+
+static void pack_int(int64_t n)
+{
+  if (n >= 0) {
+    if (n < 128) {
+      unsigned char b = n;
+      put(&b, 1);
+    } else if (n < 256) put_tag_be(0xcc, n, 1);
+    else if (n < 65536) put_tag_be(0xcd, n, 2);
+    else if (n < 4294967296LL) put_tag_be(0xce, n, 4);
+    else put_tag_be(0xcf, n, 8);
+  } else {
+    if (n >= -32) {
+      unsigned char b = n;
+      put(&b, 1);
+    } else if (n >= -128) put_tag_be(0xd0, n, 1);
+    else if (n >= -32768) put_tag_be(0xd1, n, 2);
+    else if (n >= -2147483648LL) put_tag_be(0xd2, n, 4);
+    else put_tag_be(0xd3, n, 8);
+  }
+}
+
+static void pack_double(double v)
+{
+  uint64_t bits;
+  memcpy(&bits, &v, sizeof(bits));
+  put_tag_be(0xcb, bits, 8);
+}
+
+static void pack_data(bool is_str, char const *data, size_t len)
+{
+  if (is_str && len < 32) {
+    unsigned char b = 0xa0 | len;
+    put(&b, 1);
+  } else if (len < 256) {
+    put_tag_be(is_str ? 0xd9 : 0xc4, len, 1);
+  } else if (len < 65536) {
+    put_tag_be(is_str ? 0xda : 0xc5, len, 2);
+  } else {
+    put_tag_be(is_str ? 0xdb : 0xc6, len, 4);
+  }
+  put(data, len);
+}
+
+static void pack_str(char const *s)
+{
+  pack_data(true, s, strlen(s));
+}
+
+static void pack_container(bool is_map, size_t nb_objs)
+{
+  if (nb_objs < 16) {
+    unsigned char b = (is_map ? 0x80 : 0x90) | nb_objs;
+    put(&b, 1);
+  } else if (nb_objs < 65536) {
+    put_tag_be(is_map ? 0xde : 0xdc, nb_objs, 2);
+  } else {
+    put_tag_be(is_map ? 0xdf : 0xdd, nb_objs, 4);
+  }
+}
+
+/*
+ * Records
+ *
+ * Each function writes one top level value.
+ */
+
+// Mostly fixints, some wider:
+static void gen_small_ints(void)
+{
+  uint64_t const r = rnd();
+  if (r % 8 == 0) pack_int((int64_t)(r >> 48) - 32768);
+  else pack_int((int64_t)(r >> 58) - 16);
+}
+
+static void gen_float_arrays(void)
+{
+  pack_container(false, 64);
+  for (unsigned i = 0; i < 64; i++) {
+    pack_double((double)(int64_t)rnd() / 1e15);
+  }
+}
+
+// Keys repeat from one record to the next:
+static void gen_wide_maps(void)
+{
+  pack_container(true, 100);
+  for (unsigned i = 0; i < 100; i++) {
+    char key[32];
+    snprintf(key, sizeof(key), "field_%u", i);
+    pack_str(key);
+    if (i % 3 == 0) pack_int(rnd_below(100000));
+    else if (i % 3 == 1) pack_str(i % 2 ? "some value" : "another one");
+    else pack_bool(rnd() & 1);
+  }
+}
+
+static void gen_deep_rec(unsigned depth)
+{
+  if (depth == 0) {
+    pack_int(rnd_below(1000));
+    return;
+  }
+  if (depth % 2) {
+    pack_container(true, 2);
+    pack_str("leaf");
+    pack_int(depth);
+    pack_str("down");
+  } else {
+    pack_container(false, 2);
+    pack_nil();
+  }
+  gen_deep_rec(depth - 1);
+}
+
+static void gen_deep_nesting(void)
+{
+  gen_deep_rec(64);
+}
+
+static void gen_large_bins(void)
+{
+  static char data[256 * 1024];
+  for (size_t i = 0; i < sizeof(data); i += 8) {
+    uint64_t const r = rnd();
+    memcpy(data + i, &r, 8);
+  }
+  pack_data(false, data, sizeof(data));
+}
+
+static void gen_log_records(void)
+{
+  static char const *const hosts[] = { "web-1", "web-2", "web-3", "db-1", "cache-1" };
+  static char const *const levels[] = { "debug", "info", "info", "info", "warning", "error" };
+  static char const *const paths[] = { "/", "/login", "/api/v1/items", "/api/v1/items/42", "/static/app.js" };
+  static uint64_t ts = 1700000000000ULL;
+  ts += rnd_below(50);
+
+  unsigned const nb_tags = rnd_below(4);
+  pack_container(true, 8);
+  pack_str("ts"); pack_int(ts);
+  pack_str("host"); pack_str(hosts[rnd_below(5)]);
+  pack_str("level"); pack_str(levels[rnd_below(6)]);
+  pack_str("path"); pack_str(paths[rnd_below(5)]);
+  pack_str("status"); pack_int(rnd_below(10) ? 200 : 404 + rnd_below(100));
+  pack_str("latency"); pack_double(rnd_below(1000000) / 1000.);
+  pack_str("tags");
+  pack_container(false, nb_tags);
+  for (unsigned i = 0; i < nb_tags; i++) pack_str(i % 2 ? "slow" : "retry");
+  pack_str("user");
+  pack_container(true, 2);
+  pack_str("id"); pack_int(rnd_below(1000000));
+  pack_str("agent"); pack_str("Mozilla/5.0 (X11; Linux x86_64) Gecko/20100101 Firefox/119.0");
+}
+
+static struct corpus {
+  char const *name;
+  void (*gen)(void);
+} const corpora[] = {
+  { "small-ints", gen_small_ints },
+  { "float-arrays", gen_float_arrays },
+  { "wide-maps", gen_wide_maps },
+  { "deep-nesting", gen_deep_nesting },
+  { "large-bins", gen_large_bins },
+  { "log-records", gen_log_records },
+};
+
+static void usage(char const *progname)
+{
+  fprintf(stderr, "%s [-s|--size MiB] [-S|--seed N] [-o|--out-dir DIR]\n", progname);
+}
+
+int main(int nb_args, char **args)
+{
+  unsigned long size_mib = 64;
+  char const *out_dir = ".";
+
+  static struct option const options[] = {
+    { "size", required_argument, NULL, 's' },
+    { "seed", required_argument, NULL, 'S' },
+    { "out-dir", required_argument, NULL, 'o' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 },
+  };
+  int opt;
+  while (-1 != (opt = getopt_long(nb_args, args, "s:S:o:h", options, NULL))) {
+    switch (opt) {
+      case 's':
+        size_mib = strtoul(optarg, NULL, 0);
+        break;
+      case 'S':
+        rnd_state = strtoull(optarg, NULL, 0) | 1;
+        break;
+      case 'o':
+        out_dir = optarg;
+        break;
+      case 'h':
+        usage(args[0]);
+        return 0;
+      default:
+        usage(args[0]);
+        return 1;
+    }
+  }
+
+  if (0 != mkdir(out_dir, 0755) && errno != EEXIST) {
+    fprintf(stderr, "Cannot create directory '%s': %s\n", out_dir, strerror(errno));
+    return 1;
+  }
+
+  uint64_t const size = (uint64_t)size_mib << 20;
+  for (unsigned c = 0; c < sizeof(corpora)/sizeof(corpora[0]); c++) {
+    char fname[4096];
+    snprintf(fname, sizeof(fname), "%s/%s.mp", out_dir, corpora[c].name);
+    if (! (out = fopen(fname, "w"))) {
+      fprintf(stderr, "Cannot create '%s': %s\n", fname, strerror(errno));
+      return 1;
+    }
+    uint64_t nb_records = 0;
+    for (out_bytes = 0; out_bytes < size; nb_records++) corpora[c].gen();
+    if (0 != fclose(out)) {
+      fprintf(stderr, "Cannot write '%s': %s\n", fname, strerror(errno));
+      return 1;
+    }
+
+    snprintf(fname, sizeof(fname), "%s/%s.count", out_dir, corpora[c].name);
+    FILE *f = fopen(fname, "w");
+    if (! f) {
+      fprintf(stderr, "Cannot create '%s': %s\n", fname, strerror(errno));
+      return 1;
+    }
+    fprintf(f, "%llu\n", (unsigned long long)nb_records);
+    fclose(f);
+  }
+
+  return 0;
+}
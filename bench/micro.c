@@ -0,0 +1,181 @@
+/*
+ * Microbenchmarks of msgpack-dump's decoding and formatting primitives.
+ *
+ * msgpack-dump.c is included as is (its main renamed) so that the very same
+ * static functions are measured. Everything runs from memory and output
+ * is dropped from obuf after each operation, so no syscall is involved.
+ *
+ * Each benchmark times batches of BATCH operations with clock_gettime and
+ * reports the median and high percentiles of the time per operation over
+ * all batches.
+ */
+#define main msgpack_dump_main
+#include "../msgpack-dump.c"
+#undef main
+
+#define BATCH 1000
+#define NB_SAMPLES 2000
+
+static double samples[NB_SAMPLES];
+
+static int cmp_double(void const *a_, void const *b_)
+{
+  double const *a = a_, *b = b_;
+  return *a < *b ? -1 : *a > *b;
+}
+
+static void report(char const *name)
+{
+  qsort(samples, NB_SAMPLES, sizeof(samples[0]), cmp_double);
+  printf("%-28s %9.2f %9.2f %9.2f %9.2f\n", name,
+         samples[NB_SAMPLES / 2] / BATCH,
+         samples[NB_SAMPLES * 90 / 100] / BATCH,
+         samples[NB_SAMPLES * 99 / 100] / BATCH,
+         samples[0] / BATCH);
+}
+
+// Run the statement BATCH times per sample:
+#define BENCH(name, setup, op) do { \
+  for (unsigned s_ = 0; s_ < NB_SAMPLES; s_++) { \
+    setup; \
+    double const start_ = now_ns(); \
+    for (unsigned i = 0; i < BATCH; i++) { \
+      op; \
+      olen = 0; \
+    } \
+    samples[s_] = now_ns() - start_; \
+  } \
+  report(name); \
+} while (0)
+
+// Keeps the compiler from dropping results:
+static volatile uint64_t sink;
+
+/*
+ * Inputs
+ */
+
+static uint64_t rnd_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rnd(void)
+{
+  rnd_state ^= rnd_state >> 12;
+  rnd_state ^= rnd_state << 25;
+  rnd_state ^= rnd_state >> 27;
+  return rnd_state * 0x2545f4914f6cdd1dULL;
+}
+
+static uint64_t u64s[BATCH];
+static double doubles[BATCH];
+// BATCH big endian 4 bytes ints, as found after a 0xd2 tag:
+static unsigned char varints[BATCH * 4];
+// BATCH mixed scalars, each at most 9 bytes:
+static unsigned char scalars[BATCH * 9];
+static size_t scalars_len;
+static char bytes[64];
+static char text[64];
+static char plain[64];
+// Accented text, valid UTF-8:
+static char accented[64];
+
+static void inputs_ctor(void)
+{
+  for (unsigned i = 0; i < BATCH; i++) {
+    uint64_t const r = rnd();
+    // Numbers of all sizes:
+    u64s[i] = r >> (r % 64);
+    doubles[i] = (double)(int64_t)r / (double)(1ULL << (r % 60));
+    for (unsigned b = 0; b < 4; b++) varints[i*4 + b] = r >> (8 * b);
+
+    switch (r % 5) {
+      case 0:
+        scalars[scalars_len++] = r & 0x7f;
+        break;
+      case 1:
+        scalars[scalars_len++] = r & 0x100 ? 0xc0 : r & 0x200 ? 0xc2 : 0xc3;
+        break;
+      case 2:
+        scalars[scalars_len++] = 0xcd;
+        scalars[scalars_len++] = r >> 8;
+        scalars[scalars_len++] = r >> 16;
+        break;
+      case 3:
+        scalars[scalars_len++] = 0xd2;
+        for (unsigned b = 0; b < 4; b++) scalars[scalars_len++] = r >> (8 * b);
+        break;
+      case 4:
+        scalars[scalars_len++] = 0xcb;
+        for (unsigned b = 0; b < 8; b++) scalars[scalars_len++] = r >> (8 * b);
+        break;
+    }
+  }
+  for (unsigned i = 0; i < sizeof(bytes); i++) bytes[i] = rnd();
+  // Mostly plain text with a few chars to escape:
+  for (unsigned i = 0; i < sizeof(text); i++) {
+    text[i] = i % 16 == 15 ? "\"\\\n\t"[i / 16] : (char)('a' + i % 26);
+    plain[i] = 'a' + i % 26;
+  }
+  for (unsigned i = 0; i + 1 < sizeof(accented); i += 2) memcpy(accented + i, i % 8 ? "ab" : "\xc3\xa9", 2);
+}
+
+int main(void)
+{
+  fixint_strs_ctor();
+  simd_ctor();
+  inputs_ctor();
+
+  printf("%-28s %9s %9s %9s %9s   (ns per op)\n", "", "median", "p90", "p99", "min");
+
+  struct ctx ctx;
+  char buf[MAX_NUM_LEN];
+
+  BENCH("read_varint 4 bytes", ctx_ctor_mem(&ctx, varints, sizeof(varints)),
+    uint64_t n; read_varint(&ctx, &n, 4, true); sink += n);
+
+  BENCH("tag dispatch (null)", ctx_ctor_mem(&ctx, scalars, scalars_len),
+    null_dump(&ctx, ROLE_NONE));
+
+  BENCH("tag dispatch (text)", ctx_ctor_mem(&ctx, scalars, scalars_len),
+    text_dump(&ctx, ROLE_NONE));
+
+  BENCH("dump_indent depth 8", ctx.indent = 8,
+    dump_indent(&ctx));
+
+  BENCH("fmt_u64", ,
+    sink += fmt_u64(buf, u64s[i]));
+
+  BENCH("fmt_i64", ,
+    sink += fmt_i64(buf, (int64_t)u64s[i]));
+
+  BENCH("out_fixint", ,
+    out_fixint(u64s[i]));
+
+  BENCH("fmt_double", ,
+    sink += fmt_double(buf, doubles[i], false));
+
+  BENCH("out_hex 64 bytes", ,
+    out_hex(bytes, sizeof(bytes), true));
+
+  BENCH("out_json_str 64 bytes", ,
+    out_json_str(text, sizeof(text)));
+
+  BENCH("out_csv_str 64 bytes", ,
+    out_csv_str(text, sizeof(text)));
+
+  // SIMD kernels, at every level this CPU supports:
+  for (unsigned l = 0; l <= simd_best; l++) {
+    char name[64];
+    simd_bind(l);
+    snprintf(name, sizeof(name), "hex 64 bytes, %s", simd_names[l]);
+    BENCH(name, ,
+      out_hex(bytes, sizeof(bytes), false));
+    snprintf(name, sizeof(name), "json scan 64 bytes, %s", simd_names[l]);
+    BENCH(name, ,
+      sink += json_scan((unsigned char const *)plain, sizeof(plain)));
+    snprintf(name, sizeof(name), "utf8 check 64 bytes, %s", simd_names[l]);
+    BENCH(name, ,
+      sink += utf8_check((unsigned char const *)accented, sizeof(accented)));
+  }
+
+  return 0;
+}
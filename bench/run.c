@@ -0,0 +1,234 @@
+/*
+ * Runs msgpack-dump over every file of the corpus in every output mode and
+ * reports throughput and peak memory, compared to a saved baseline if any.
+ *
+ * Each run is repeated and the fastest one is kept. Output goes to
+ * /dev/null. The baseline is a plain text file with one line per corpus
+ * and mode: "corpus mode MB/s records/s maxrss_KiB".
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+static char const *const corpora[] = {
+  "small-ints", "float-arrays", "wide-maps", "deep-nesting", "large-bins", "log-records",
+};
+
+static char const *const modes[] = {
+  "text", "compact", "json", "ndjson", "csv", "null",
+};
+
+#define NB_CORPORA (sizeof(corpora)/sizeof(corpora[0]))
+#define NB_MODES (sizeof(modes)/sizeof(modes[0]))
+
+struct result {
+  double mbps;
+  double recps;
+  long maxrss;  // KiB
+};
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Run the command once, returning the wall clock time and peak RSS:
+static bool run_once(char const *prog, char const *mode, char const *fname, double *duration, long *maxrss)
+{
+  double const start = now();
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Cannot fork: %s\n", strerror(errno));
+    return false;
+  }
+  if (pid == 0) {
+    int fd = open("/dev/null", O_WRONLY);
+    if (fd < 0 || dup2(fd, 1) < 0) _exit(127);
+    execl(prog, prog, "-m", mode, fname, (char *)NULL);
+    fprintf(stderr, "Cannot exec %s: %s\n", prog, strerror(errno));
+    _exit(127);
+  }
+
+  int status;
+  struct rusage ru;
+  while (wait4(pid, &status, 0, &ru) < 0) {
+    if (errno != EINTR) {
+      fprintf(stderr, "Cannot wait for %s: %s\n", prog, strerror(errno));
+      return false;
+    }
+  }
+  *duration = now() - start;
+  *maxrss = ru.ru_maxrss;
+  if (! WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "%s -m %s %s failed\n", prog, mode, fname);
+    return false;
+  }
+  return true;
+}
+
+static bool load_count(char const *dir, char const *corpus, uint64_t *count)
+{
+  char fname[4096];
+  snprintf(fname, sizeof(fname), "%s/%s.count", dir, corpus);
+  FILE *f = fopen(fname, "r");
+  if (! f) {
+    fprintf(stderr, "Cannot open '%s': %s\n", fname, strerror(errno));
+    return false;
+  }
+  unsigned long long n;
+  bool ok = 1 == fscanf(f, "%llu", &n);
+  fclose(f);
+  if (! ok) {
+    fprintf(stderr, "Cannot read a count from '%s'\n", fname);
+    return false;
+  }
+  *count = n;
+  return true;
+}
+
+// Returns false if there is no baseline:
+static bool load_baseline(char const *fname, struct result baseline[NB_CORPORA][NB_MODES])
+{
+  FILE *f = fopen(fname, "r");
+  if (! f) return false;
+  memset(baseline, 0, sizeof(struct result) * NB_CORPORA * NB_MODES);
+  char corpus[256], mode[256];
+  struct result r;
+  while (5 == fscanf(f, "%255s %255s %lf %lf %ld", corpus, mode, &r.mbps, &r.recps, &r.maxrss)) {
+    for (unsigned c = 0; c < NB_CORPORA; c++) {
+      for (unsigned m = 0; m < NB_MODES; m++) {
+        if (0 == strcmp(corpus, corpora[c]) && 0 == strcmp(mode, modes[m])) baseline[c][m] = r;
+      }
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+static bool save_baseline(char const *fname, struct result results[NB_CORPORA][NB_MODES])
+{
+  FILE *f = fopen(fname, "w");
+  if (! f) {
+    fprintf(stderr, "Cannot create '%s': %s\n", fname, strerror(errno));
+    return false;
+  }
+  for (unsigned c = 0; c < NB_CORPORA; c++) {
+    for (unsigned m = 0; m < NB_MODES; m++) {
+      struct result const *r = &results[c][m];
+      fprintf(f, "%s %s %.2f %.0f %ld\n", corpora[c], modes[m], r->mbps, r->recps, r->maxrss);
+    }
+  }
+  return 0 == fclose(f);
+}
+
+static void usage(char const *progname)
+{
+  fprintf(stderr, "%s [-d|--corpus DIR] [-n|--repeat N] [-b|--baseline FILE] [-s|--save] msgpack-dump\n", progname);
+}
+
+int main(int nb_args, char **args)
+{
+  char const *dir = "bench/corpus";
+  char const *baseline_fname = "bench/baseline.txt";
+  unsigned repeat = 3;
+  bool save = false;
+
+  static struct option const options[] = {
+    { "corpus", required_argument, NULL, 'd' },
+    { "repeat", required_argument, NULL, 'n' },
+    { "baseline", required_argument, NULL, 'b' },
+    { "save", no_argument, NULL, 's' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 },
+  };
+  int opt;
+  while (-1 != (opt = getopt_long(nb_args, args, "d:n:b:sh", options, NULL))) {
+    switch (opt) {
+      case 'd':
+        dir = optarg;
+        break;
+      case 'n':
+        repeat = strtoul(optarg, NULL, 0);
+        if (repeat == 0) repeat = 1;
+        break;
+      case 'b':
+        baseline_fname = optarg;
+        break;
+      case 's':
+        save = true;
+        break;
+      case 'h':
+        usage(args[0]);
+        return 0;
+      default:
+        usage(args[0]);
+        return 1;
+    }
+  }
+  if (optind != nb_args - 1) {
+    usage(args[0]);
+    return 1;
+  }
+  char const *prog = args[optind];
+
+  static struct result results[NB_CORPORA][NB_MODES], baseline[NB_CORPORA][NB_MODES];
+  bool const has_baseline = ! save && load_baseline(baseline_fname, baseline);
+
+  printf("%-14s %-8s %10s %12s %10s%s\n", "corpus", "mode", "MB/s", "records/s", "maxrss KiB",
+         has_baseline ? "   vs baseline" : "");
+
+  for (unsigned c = 0; c < NB_CORPORA; c++) {
+    char fname[4096];
+    snprintf(fname, sizeof(fname), "%s/%s.mp", dir, corpora[c]);
+    struct stat st;
+    if (0 != stat(fname, &st)) {
+      fprintf(stderr, "Cannot stat '%s': %s\n", fname, strerror(errno));
+      return 1;
+    }
+    uint64_t count;
+    if (! load_count(dir, corpora[c], &count)) return 1;
+
+    for (unsigned m = 0; m < NB_MODES; m++) {
+      double best = 0;
+      long maxrss = 0;
+      for (unsigned i = 0; i < repeat; i++) {
+        double duration;
+        long rss;
+        if (! run_once(prog, modes[m], fname, &duration, &rss)) return 1;
+        if (i == 0 || duration < best) best = duration;
+        if (rss > maxrss) maxrss = rss;
+      }
+      struct result *r = &results[c][m];
+      r->mbps = st.st_size / best / 1e6;
+      r->recps = count / best;
+      r->maxrss = maxrss;
+
+      printf("%-14s %-8s %10.2f %12.0f %10ld", corpora[c], modes[m], r->mbps, r->recps, r->maxrss);
+      struct result const *b = &baseline[c][m];
+      if (has_baseline && b->mbps > 0) {
+        printf("   %+6.1f%% speed, %+ld KiB", 100. * (r->mbps / b->mbps - 1.), r->maxrss - b->maxrss);
+      }
+      printf("\n");
+      fflush(stdout);
+    }
+  }
+
+  if (save) {
+    if (! save_baseline(baseline_fname, results)) return 1;
+    printf("Baseline saved in %s\n", baseline_fname);
+  }
+  return 0;
+}
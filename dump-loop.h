@@ -0,0 +1,501 @@
+/*
+ * Decoding loop, instantiated once per output mode.
+ *
+ * Before including this file, define MODE to the prefix of the emitter
+ * functions to use (MODE_emit_nil, MODE_emit_str...). This defines
+ * MODE_dump and its helpers, which call those emitters directly so that
+ * the compiler can inline them and no mode has to pay for the others.
+ *
+ * KEY_CACHE can also be defined to a struct key_cache * in which short str
+ * map keys are remembered already formatted. The mode must then also
+ * define MODE_emit_key_prefix, outputting whatever MODE_emit_start outputs
+ * before a str key.
+ *
+ * STR_KEYS can be defined to the dump function of a compact mode, for modes
+ * whose map keys must be strings: keys that are containers or exts are then
+ * printed with it and quoted with out_json_str.
+ *
+ * SHAPES can be defined to a struct shapes * for MODE_dump_record, which
+ * dumps a top level value, to learn record shapes and reuse their constant
+ * output. Otherwise MODE_dump_record is just MODE_dump.
+ */
+
+#ifndef MODE
+# error "MODE must be defined"
+#endif
+
+#define FN__(m, n) m##_##n
+#define FN_(m, n) FN__(m, n)
+#define FN(n) FN_(MODE, n)
+
+static bool FN(dump)(struct ctx *, int role);
+
+static bool FN(dump_varint)(struct ctx *ctx, size_t lenlen, bool sign)
+{
+  uint64_t n;
+  if (! read_varint(ctx, &n, lenlen, sign)) return false;
+
+  if (sign) {
+    FN(emit_int)(ctx, n);
+  } else {
+    FN(emit_uint)(ctx, n);
+  }
+  return true;
+}
+
+static bool FN(dump_float)(struct ctx *ctx, size_t width)
+{
+  uint64_t bits;
+  if (! read_varuint(ctx, &bits, width)) return false;
+  FN(emit_float)(ctx, float_of_bits(bits, width));
+  return true;
+}
+
+// Decode a payload that holds a single msgpack value, indented as if it
+// was there in place of the payload. Returns false if it does not look
+// like msgpack, having printed nothing.
+static bool FN(dump_nested)(struct ctx *ctx, char const *data, size_t len)
+{
+  if (len == 0 || value_size((unsigned char const *)data, len) != len) return false;
+  struct ctx inner;
+  ctx_ctor_mem(&inner, (unsigned char const *)data, len);
+  inner.indent = ctx->indent;
+  // Only fails if out of memory, once the trial parse succeeded:
+  return FN(dump)(&inner, ROLE_INLINE);
+}
+
+static bool FN(dump_data)(struct ctx *ctx, bool is_str, size_t len)
+{
+  if (! is_str && extract.path && extract_here(ctx)) {
+    char fname[PATH_MAX];
+    size_t fname_len;
+    if (! extract_bin(ctx, len, fname, &fname_len)) return false;
+    FN(emit_str)(ctx, fname, fname_len);
+    return true;
+  }
+  if (FN(skip_data)) return ediscard(ctx, len);
+
+  char *data = arena_alloc(&arena, len);
+  if (! data) return false;
+  if (! eread(ctx, data, len)) return false;
+
+  if (is_str) {
+    FN(emit_str)(ctx, data, len);
+  } else if (! nested_bin || ! FN(dump_nested)(ctx, data, len)) {
+    FN(emit_bin)(ctx, data, len);
+  }
+  return true;
+}
+
+static bool FN(dump_data_var)(struct ctx *ctx, bool is_str, size_t lenlen)
+{
+  uint64_t len;
+  if (! read_varuint(ctx, &len, lenlen)) return false;
+  return FN(dump_data)(ctx, is_str, len);
+}
+
+// Items from n on of an array, one per line:
+static bool FN(dump_items)(struct ctx *ctx, size_t n, size_t nb_objs)
+{
+  for (; n < nb_objs; n++) {
+    bool const entered = extract.path && extract_enter(ctx, n, false);
+    if (! FN(dump)(ctx, n)) return false;
+    if (entered) extract.depth --;
+  }
+  ctx->indent --;
+  FN(emit_array_close)(ctx, nb_objs);
+  return true;
+}
+
+static bool FN(dump_num_array)(struct ctx *ctx, size_t nb_objs)
+{
+  uint64_t vals[RUN_MAX];
+
+  FN(emit_num_array_open)(ctx, nb_objs);
+  ctx->indent ++;
+
+  for (size_t n = 0; n < nb_objs; ) {
+    unsigned char const *p = epeek(ctx, 1);
+    int const width = p ? num_width(*p) : -1;
+    if (p && width < 0) {
+      // Not a number, past what nums_ahead() could see:
+      FN(emit_num_array_break)(ctx);
+      return FN(dump_items)(ctx, n, nb_objs);
+    }
+    // The second peek may refill the buffer, moving the tag:
+    if (! p || ! (p = epeek(ctx, 1 + width))) {
+      fprintf(stderr, "Truncated array at offset %zu\n", ctx->offset);
+      return false;
+    }
+    unsigned char const fst = *p;
+    size_t const nb = read_num_run(ctx, fst, width, nb_objs - n, vals);
+    PROF_VALUES(fst, nb, nb * (1 + width));
+    FN(emit_num_run)(ctx, fst, vals, nb, n);
+    n += nb;
+  }
+
+  ctx->indent --;
+  FN(emit_num_array_close)(ctx, nb_objs);
+  return true;
+}
+
+static bool FN(dump_array)(struct ctx *ctx, size_t nb_objs)
+{
+  if (nb_objs > 0 && nums_ahead(ctx, nb_objs)) return FN(dump_num_array)(ctx, nb_objs);
+
+  FN(emit_array_open)(ctx, nb_objs);
+  ctx->indent ++;
+  return FN(dump_items)(ctx, 0, nb_objs);
+}
+
+static bool FN(dump_array_var)(struct ctx *ctx, size_t lenlen)
+{
+  uint64_t len;
+  if (! read_varuint(ctx, &len, lenlen)) return false;
+  return FN(dump_array)(ctx, len);
+}
+
+#ifdef KEY_CACHE
+// Print the next key from the cache, or format it and add it to the cache.
+// Return false if the key is not a short enough str, which must then go
+// through dump().
+static bool FN(dump_cached_key)(struct ctx *ctx)
+{
+  unsigned char const *p = epeek(ctx, 1);
+  if (! p) return false;
+  size_t hdr_len, raw_len;
+  if ((p[0] & 0xe0) == 0xa0) {
+    hdr_len = 1;
+    raw_len = 1 + (p[0] & 0x1f);
+  } else if (p[0] == 0xd9 && (p = epeek(ctx, 2)) && p[1] <= KEY_MAX_LEN) {
+    hdr_len = 2;
+    raw_len = 2 + p[1];
+  } else {
+    return false;
+  }
+  if (! (p = epeek(ctx, raw_len))) return false;
+  PROF_VALUES(p[0], 1, raw_len);
+
+  struct key_cache_entry *e = KEY_CACHE->entries + (key_hash(p, raw_len) & (KEY_CACHE_SIZE - 1));
+  FN(emit_key_prefix)(ctx);
+  if (e->raw_len == raw_len && 0 == memcmp(e->raw, p, raw_len)) {
+    out_mem(e->out, e->out_len);
+  } else {
+    // Make sure the formatted key stays in obuf:
+    (void)out_reserve(KEY_MAX_OUT_LEN);
+    size_t const start = olen;
+    FN(emit_str)(ctx, (char const *)p + hdr_len, raw_len - hdr_len);
+    FN(emit_stop)(ctx, ROLE_MAP_KEY);
+    size_t const out_len = olen - start;
+    if (out_len <= sizeof(e->out)) {
+      e->raw_len = raw_len;
+      memcpy(e->raw, p, raw_len);
+      e->out_len = out_len;
+      memcpy(e->out, obuf + start, out_len);
+    }
+  }
+  eskip(ctx, raw_len);
+  return true;
+}
+#endif
+
+#ifdef STR_KEYS
+static bool FN(dump_str_key)(struct ctx *ctx)
+{
+  unsigned char const *p = epeek(ctx, 1);
+  bool const nested = p && (
+    (p[0] & 0xe0) == 0x80 || (p[0] >= 0xdc && p[0] <= 0xdf) ||  // map, array
+    (p[0] >= 0xc7 && p[0] <= 0xc9) || (p[0] >= 0xd4 && p[0] <= 0xd8));  // ext
+  if (! nested) return FN(dump)(ctx, ROLE_MAP_KEY);
+
+  // The key is printed in obuf, then replaced by its quoted form:
+  size_t const offset = ctx->offset, start = olen;
+  uint64_t const nb_flushes = out_nb_flushes;
+  if (! STR_KEYS(ctx, ROLE_INLINE)) return false;
+  if (out_nb_flushes != nb_flushes) {
+    fprintf(stderr, "Map key at offset %zu is too long to be quoted\n", offset);
+    return false;
+  }
+  // Unless an ext decoder printed it as a string already:
+  if (obuf[start] != '"') {
+    size_t const len = olen - start;
+    char *key = arena_alloc(&arena, len);
+    if (! key) return false;
+    memcpy(key, obuf + start, len);
+    olen = start;
+    out_json_str(key, len);
+  }
+  FN(emit_stop)(ctx, ROLE_MAP_KEY);
+  return true;
+}
+#endif
+
+static bool FN(dump_map)(struct ctx *ctx, size_t nb_objs)
+{
+  FN(emit_map_open)(ctx, nb_objs);
+  ctx->indent ++;
+
+  for (unsigned n = 0; n < nb_objs; n++) {
+    FN(emit_map_item)(ctx, n);
+    bool const entered = extract.path && extract_enter(ctx, n, true);
+#   ifdef KEY_CACHE
+    bool const cached = FN(dump_cached_key)(ctx);
+#   else
+    bool const cached = false;
+#   endif
+#   ifdef STR_KEYS
+    if (! cached && ! FN(dump_str_key)(ctx)) return false;
+#   else
+    if (! cached && ! FN(dump)(ctx, ROLE_MAP_KEY)) return false;
+#   endif
+    if (! FN(dump)(ctx, ROLE_MAP_VALUE)) return false;
+    if (entered) extract.depth --;
+  }
+
+  ctx->indent --;
+  FN(emit_map_close)(ctx, nb_objs);
+  return true;
+}
+
+static bool FN(dump_map_var)(struct ctx *ctx, size_t lenlen)
+{
+  uint64_t len;
+  if (! read_varuint(ctx, &len, lenlen)) return false;
+  return FN(dump_map)(ctx, len);
+}
+
+static bool FN(dump_ext)(struct ctx *ctx, size_t len)
+{
+  unsigned char type;
+  if (! eread(ctx, &type, 1)) return false;
+  if (FN(skip_data)) return ediscard(ctx, len);
+
+  char *data = arena_alloc(&arena, len);
+  if (! data) return false;
+  if (! eread(ctx, data, len)) return false;
+
+  if (! nested_ext[type] || ! FN(dump_nested)(ctx, data, len)) {
+    FN(emit_ext)(ctx, type, data, len);
+  }
+  return true;
+}
+
+static bool FN(dump_ext_var)(struct ctx *ctx, size_t lenlen)
+{
+  uint64_t len;
+  if (! read_varuint(ctx, &len, lenlen)) return false;
+  return FN(dump_ext)(ctx, len);
+}
+
+static bool FN(dump)(struct ctx *ctx, int role)
+{
+  unsigned char fst;
+  PROF_DECL(size_t const prof_start = ctx->offset);
+  if (! eread(ctx, &fst, 1)) return ctx->eof;
+
+  FN(emit_start)(ctx, role);
+
+  if (fst == 0xc0) FN(emit_nil)(ctx);
+  else if (fst == 0xc2) FN(emit_bool)(ctx, false);
+  else if (fst == 0xc3) FN(emit_bool)(ctx, true);
+  else if ((fst & 0x80) == 0) FN(emit_fixint)(ctx, fst);
+  else if ((fst & 0xe0) == 0xe0) FN(emit_fixint)(ctx, fst);
+  else if (fst == 0xcc) {
+    if (! FN(dump_varint)(ctx, 1, false)) return false;
+  } else if (fst == 0xcd) {
+    if (! FN(dump_varint)(ctx, 2, false)) return false;
+  } else if (fst == 0xce) {
+    if (! FN(dump_varint)(ctx, 4, false)) return false;
+  } else if (fst == 0xcf) {
+    if (! FN(dump_varint)(ctx, 8, false)) return false;
+  } else if (fst == 0xd0) {
+    if (! FN(dump_varint)(ctx, 1, true)) return false;
+  } else if (fst == 0xd1) {
+    if (! FN(dump_varint)(ctx, 2, true)) return false;
+  } else if (fst == 0xd2) {
+    if (! FN(dump_varint)(ctx, 4, true)) return false;
+  } else if (fst == 0xd3) {
+    if (! FN(dump_varint)(ctx, 8, true)) return false;
+  } else if (fst == 0xca) {
+    if (! FN(dump_float)(ctx, 4)) return false;
+  } else if (fst == 0xcb) {
+    if (! FN(dump_float)(ctx, 8)) return false;
+  } else if ((fst & 0xe0) == 0xa0) {
+    if (! FN(dump_data)(ctx, true, fst & 0x1f)) return false;
+  } else if (fst == 0xd9) {
+    if (! FN(dump_data_var)(ctx, true, 1)) return false;
+  } else if (fst == 0xda) {
+    if (! FN(dump_data_var)(ctx, true, 2)) return false;
+  } else if (fst == 0xdb) {
+    if (! FN(dump_data_var)(ctx, true, 4)) return false;
+  } else if (fst == 0xc4) {
+    if (! FN(dump_data_var)(ctx, false, 1)) return false;
+  } else if (fst == 0xc5) {
+    if (! FN(dump_data_var)(ctx, false, 2)) return false;
+  } else if (fst == 0xc6) {
+    if (! FN(dump_data_var)(ctx, false, 4)) return false;
+  } else if ((fst & 0xf0) == 0x90) {
+    if (! FN(dump_array)(ctx, fst & 0x0f)) return false;
+  } else if (fst == 0xdc) {
+    if (! FN(dump_array_var)(ctx, 2)) return false;
+  } else if (fst == 0xdd) {
+    if (! FN(dump_array_var)(ctx, 4)) return false;
+  } else if ((fst & 0xf0) == 0x80) {
+    if (! FN(dump_map)(ctx, fst & 0x0f)) return false;
+  } else if (fst == 0xde) {
+    if (! FN(dump_map_var)(ctx, 2)) return false;
+  } else if (fst == 0xdf) {
+    if (! FN(dump_map_var)(ctx, 4)) return false;
+  } else if (fst == 0xd4) {
+    if (! FN(dump_ext)(ctx, 1)) return false;
+  } else if (fst == 0xd5) {
+    if (! FN(dump_ext)(ctx, 2)) return false;
+  } else if (fst == 0xd6) {
+    if (! FN(dump_ext)(ctx, 4)) return false;
+  } else if (fst == 0xd7) {
+    if (! FN(dump_ext)(ctx, 8)) return false;
+  } else if (fst == 0xd8) {
+    if (! FN(dump_ext)(ctx, 16)) return false;
+  } else if (fst == 0xc7) {
+    if (! FN(dump_ext_var)(ctx, 1)) return false;
+  } else if (fst == 0xc8) {
+    if (! FN(dump_ext_var)(ctx, 2)) return false;
+  } else if (fst == 0xc9) {
+    if (! FN(dump_ext_var)(ctx, 4)) return false;
+  } else {
+    fprintf(stderr, "Bad tag %02x\n", fst);
+    return false;
+  }
+
+  FN(emit_stop)(ctx, role);
+  PROF_VALUE(fst, prof_start, ctx->offset);
+  return true;
+}
+
+#ifdef SHAPES
+// Print a scalar that is entirely in memory.
+static void FN(emit_scalar)(struct ctx *ctx, unsigned char const *p)
+{
+  unsigned char const fst = p[0];
+  size_t hdr_len;
+  switch (fst) {
+    case 0xc0: FN(emit_nil)(ctx); return;
+    case 0xc2: FN(emit_bool)(ctx, false); return;
+    case 0xc3: FN(emit_bool)(ctx, true); return;
+    case 0xcc: FN(emit_uint)(ctx, p[1]); return;
+    case 0xcd: FN(emit_uint)(ctx, load_be(p + 1, 2)); return;
+    case 0xce: FN(emit_uint)(ctx, load_be(p + 1, 4)); return;
+    case 0xcf: FN(emit_uint)(ctx, load_be(p + 1, 8)); return;
+    case 0xd0: FN(emit_int)(ctx, sign_extend(p[1], 1)); return;
+    case 0xd1: FN(emit_int)(ctx, sign_extend(load_be(p + 1, 2), 2)); return;
+    case 0xd2: FN(emit_int)(ctx, sign_extend(load_be(p + 1, 4), 4)); return;
+    case 0xd3: FN(emit_int)(ctx, load_be(p + 1, 8)); return;
+    case 0xca: FN(emit_float)(ctx, float_of_bits(load_be(p + 1, 4), 4)); return;
+    case 0xcb: FN(emit_float)(ctx, float_of_bits(load_be(p + 1, 8), 8)); return;
+    case 0xc4: case 0xc5: case 0xc6: {
+      hdr_len = 1 + (1 << (fst - 0xc4));
+      char const *data = (char const *)p + hdr_len;
+      size_t const len = load_be(p + 1, hdr_len - 1);
+      if (! nested_bin || ! FN(dump_nested)(ctx, data, len)) FN(emit_bin)(ctx, data, len);
+      return;
+    }
+  }
+  if ((fst & 0x80) == 0 || (fst & 0xe0) == 0xe0) {
+    FN(emit_fixint)(ctx, fst);
+  } else if ((hdr_len = str_hdr_len(fst)) == 1) {
+    FN(emit_str)(ctx, (char const *)p + 1, fst & 0x1f);
+  } else {
+    FN(emit_str)(ctx, (char const *)p + hdr_len, load_be(p + 1, hdr_len - 1));
+  }
+}
+
+// Record the constant output of a newly seen shape, by running the
+// emitters of a map without its values and cutting the output where each
+// value would go.
+static void FN(shape_learn)(struct ctx *ctx, struct shape *s, struct shape_scan const *sc)
+{
+  unsigned char const *rec = ctx->ibuf + ctx->ipos;
+  // Capture from an empty obuf (a learned shape is much smaller than obuf):
+  out_flush();
+
+  FN(emit_start)(ctx, ROLE_NONE);
+  FN(emit_map_open)(ctx, sc->nb_fields);
+  ctx->indent ++;
+  for (unsigned n = 0; n < sc->nb_fields; n++) {
+    unsigned char const *k = rec + sc->keys[n];
+    size_t const hdr_len = str_hdr_len(k[0]);
+    size_t const len = hdr_len == 1 ? (k[0] & 0x1f) : load_be(k + 1, hdr_len - 1);
+    FN(emit_map_item)(ctx, n);
+    FN(emit_start)(ctx, ROLE_MAP_KEY);
+    FN(emit_str)(ctx, (char const *)k + hdr_len, len);
+    FN(emit_stop)(ctx, ROLE_MAP_KEY);
+    FN(emit_start)(ctx, ROLE_MAP_VALUE);
+    s->value_at[n] = olen;
+    FN(emit_stop)(ctx, ROLE_MAP_VALUE);
+  }
+  ctx->indent --;
+  FN(emit_map_close)(ctx, sc->nb_fields);
+  FN(emit_stop)(ctx, ROLE_NONE);
+  s->value_at[sc->nb_fields] = olen;
+
+  char *text = realloc(s->text, olen);
+  if (! text) {
+    fprintf(stderr, "Cannot alloc %zu bytes\n", olen);
+    exit(1);
+  }
+  memcpy(text, obuf, olen);
+  olen = 0;
+  s->text = text;
+  s->sig_len = sc->sig_len;
+  s->nb_fields = sc->nb_fields;
+  memcpy(s->sig, sc->sig, sc->sig_len);
+}
+
+static bool FN(dump_record)(struct ctx *ctx)
+{
+  static struct shape_scan sc;
+  // Shapes print values from memory, bins included:
+  if (extract.path || ! shape_scan(ctx, &sc)) return FN(dump)(ctx, ROLE_NONE);
+
+  struct shape *s = SHAPES->last;
+  if (! s || s->sig_len != sc.sig_len || 0 != memcmp(s->sig, sc.sig, sc.sig_len)) {
+    uint32_t const hash = key_hash(sc.sig, sc.sig_len);
+    s = SHAPES->s + (hash % SHAPE_NB);
+    if (s->hash != hash || s->sig_len != sc.sig_len || 0 != memcmp(s->sig, sc.sig, sc.sig_len)) {
+      FN(shape_learn)(ctx, s, &sc);
+      s->hash = hash;
+    }
+    SHAPES->last = s;
+  }
+
+  unsigned char const *rec = ctx->ibuf + ctx->ipos;
+  size_t done = 0;
+  PROF_VALUES(rec[0], 1, sc.keys[0]);
+  ctx->indent ++;
+  for (unsigned n = 0; n < sc.nb_fields; n++) {
+    PROF_VALUES(rec[sc.keys[n]], 1, sc.vals[n] - sc.keys[n]);
+    PROF_VALUES(rec[sc.vals[n]], 1, (n + 1 < sc.nb_fields ? sc.keys[n + 1] : sc.len) - sc.vals[n]);
+    out_mem(s->text + done, s->value_at[n] - done);
+    FN(emit_scalar)(ctx, rec + sc.vals[n]);
+    done = s->value_at[n];
+  }
+  ctx->indent --;
+  out_mem(s->text + done, s->value_at[sc.nb_fields] - done);
+
+  eskip(ctx, sc.len);
+  return true;
+}
+#else
+static inline bool FN(dump_record)(struct ctx *ctx)
+{
+  return FN(dump)(ctx, ROLE_NONE);
+}
+#endif
+
+#undef FN
+#undef FN_
+#undef FN__
+#undef MODE
+#undef KEY_CACHE
+#undef STR_KEYS
+#undef SHAPES
@@ -0,0 +1,530 @@
+/*
+ * Generates a C decoder specialized for one record layout.
+ *
+ * The schema lists the fields of the record, one "key type" per line, in
+ * the order they are expected to come in; types are bool, int, uint,
+ * float, str and bin. Empty lines and lines starting with # are ignored:
+ *
+ *   # access logs
+ *   ts uint
+ *   host str
+ *   latency float
+ *
+ * Struct members are named after the keys, with chars that are not valid
+ * in C identifiers replaced by _. Names clashing with earlier fields (case
+ * aside), C keywords or the names the generated code uses get _2, _3...
+ * appended.
+ *
+ * The generated code defines a struct with one member per field and a
+ * NAME_decode() function filling it from a msgpack map. Maps with exactly
+ * those keys in that order, and values encoded the usual way, take a fast
+ * path that merely checks the raw key bytes and tags as it goes. Anything
+ * else (other key order, missing or extra keys, other encodings) goes
+ * through a generic, order independent, decoder.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+
+#define MAX_FIELDS 64
+
+enum type { T_BOOL, T_INT, T_UINT, T_FLOAT, T_STR, T_BIN };
+
+static struct type_info {
+  char const *name;
+  char const *decl;  // of the struct member(s), printf'ed with the C name
+  char const *getter;
+} const types[] = {
+  [T_BOOL] = { "bool", "  bool %s;\n", "mpgen_bool" },
+  [T_INT] = { "int", "  int64_t %s;\n", "mpgen_int" },
+  [T_UINT] = { "uint", "  uint64_t %s;\n", "mpgen_uint" },
+  [T_FLOAT] = { "float", "  double %s;\n", "mpgen_float" },
+  [T_STR] = { "str", "  struct mpgen_data %s;\n", "mpgen_str" },
+  [T_BIN] = { "bin", "  struct mpgen_data %s;\n", "mpgen_bin" },
+};
+
+struct field {
+  char *key;
+  char *cname;
+  enum type type;
+};
+
+static bool type_of_name(enum type *t, char const *name)
+{
+  for (unsigned i = 0; i < sizeof(types)/sizeof(types[0]); i++) {
+    if (0 == strcmp(name, types[i].name)) {
+      *t = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Names fields cannot take: C keywords, and what the generated code uses
+// (the present member, the NAME_HAS_ALL macro):
+static char const *const reserved[] = {
+  "present", "all",
+  "auto", "break", "case", "char", "const", "continue", "default", "do",
+  "double", "else", "enum", "extern", "float", "for", "goto", "if",
+  "inline", "int", "long", "register", "restrict", "return", "short",
+  "signed", "sizeof", "static", "struct", "switch", "typedef", "union",
+  "unsigned", "void", "volatile", "while", "bool", "true", "false",
+};
+
+// Names are compared regardless of case, since the NAME_HAS_ macros are
+// upper case:
+static bool cname_taken(char const *c, struct field const *fields, unsigned nb_fields)
+{
+  for (unsigned i = 0; i < sizeof(reserved)/sizeof(reserved[0]); i++) {
+    if (0 == strcasecmp(c, reserved[i])) return true;
+  }
+  for (unsigned i = 0; i < nb_fields; i++) {
+    if (0 == strcasecmp(c, fields[i].cname)) return true;
+  }
+  return false;
+}
+
+// Make a C identifier out of a key, distinct from those of the previous
+// fields: keys that differ only by chars that are not alphanumeric, or by
+// case, get _2, _3... appended.
+static char *cname_of_key(char const *key, struct field const *fields, unsigned nb_fields)
+{
+  size_t const len = strlen(key);
+  size_t const sz = len + 2 + 11;
+  char *c = malloc(sz);
+  if (! c) {
+    fprintf(stderr, "Cannot alloc %zu bytes\n", sz);
+    exit(1);
+  }
+  size_t o = 0;
+  if (isdigit((unsigned char)key[0])) c[o++] = '_';
+  for (size_t i = 0; i < len; i++) {
+    c[o++] = isalnum((unsigned char)key[i]) ? key[i] : '_';
+  }
+  c[o] = '\0';
+  for (unsigned n = 2; cname_taken(c, fields, nb_fields); n++) {
+    snprintf(c + o, sz - o, "_%u", n);
+  }
+  return c;
+}
+
+static unsigned read_schema(FILE *f, char const *fname, struct field *fields)
+{
+  unsigned nb_fields = 0;
+  char line[4096];
+  for (unsigned lineno = 1; fgets(line, sizeof(line), f); lineno++) {
+    char key[sizeof(line)], type[sizeof(line)];
+    char const *s = line;
+    while (isspace((unsigned char)*s)) s++;
+    if (*s == '\0' || *s == '#') continue;
+    enum type t;
+    if (2 != sscanf(s, "%s %s", key, type) || ! type_of_name(&t, type)) {
+      fprintf(stderr, "%s:%u: expected a key and a type (bool, int, uint, float, str or bin)\n", fname, lineno);
+      exit(1);
+    }
+    if (nb_fields >= MAX_FIELDS) {
+      fprintf(stderr, "%s:%u: too many fields (max %d)\n", fname, lineno, MAX_FIELDS);
+      exit(1);
+    }
+    for (unsigned i = 0; i < nb_fields; i++) {
+      if (0 == strcmp(fields[i].key, key)) {
+        fprintf(stderr, "%s:%u: duplicate key %s\n", fname, lineno, key);
+        exit(1);
+      }
+    }
+    fields[nb_fields].key = strdup(key);
+    fields[nb_fields].cname = cname_of_key(key, fields, nb_fields);
+    fields[nb_fields].type = t;
+    nb_fields ++;
+  }
+  if (nb_fields == 0) {
+    fprintf(stderr, "%s: no fields\n", fname);
+    exit(1);
+  }
+  return nb_fields;
+}
+
+// Print bytes as a C string literal:
+static void print_literal(unsigned char const *data, size_t len)
+{
+  putchar('"');
+  for (size_t i = 0; i < len; i++) printf("\\x%02x", data[i]);
+  putchar('"');
+}
+
+// Print the key as msgpack would normally encode it, and return its size:
+static size_t print_raw_key(char const *key)
+{
+  unsigned char raw[5 + 4096];
+  size_t const len = strlen(key);
+  size_t hdr_len;
+  if (len < 32) {
+    raw[0] = 0xa0 | len;
+    hdr_len = 1;
+  } else if (len < 256) {
+    raw[0] = 0xd9;
+    raw[1] = len;
+    hdr_len = 2;
+  } else {
+    raw[0] = 0xda;
+    raw[1] = len >> 8;
+    raw[2] = len;
+    hdr_len = 3;
+  }
+  memcpy(raw + hdr_len, key, len);
+  print_literal(raw, hdr_len + len);
+  return hdr_len + len;
+}
+
+// Helpers shared by all generated decoders:
+static char const helpers[] =
+  "#ifndef MPGEN_HELPERS\n"
+  "#define MPGEN_HELPERS\n"
+  "\n"
+  "struct mpgen_data {\n"
+  "  char const *ptr;  // into the input buffer\n"
+  "  size_t len;\n"
+  "};\n"
+  "\n"
+  "static inline uint64_t mpgen_be(unsigned char const *p, size_t len)\n"
+  "{\n"
+  "  uint64_t n = 0;\n"
+  "  for (size_t i = 0; i < len; i++) n = (n << 8) | p[i];\n"
+  "  return n;\n"
+  "}\n"
+  "\n"
+  "// Size of the value at p, or 0 if it's malformed or truncated:\n"
+  "static size_t mpgen_skip(unsigned char const *p, size_t len)\n"
+  "{\n"
+  "  unsigned char const *const start = p, *const end = p + len;\n"
+  "  uint64_t pending = 1;\n"
+  "  for (; pending > 0; pending--) {\n"
+  "    if (p >= end) return 0;\n"
+  "    unsigned char const fst = *p++;\n"
+  "    size_t lenlen = 0, fixed = 0;\n"
+  "    uint64_t nb_objs = 0;\n"
+  "    bool is_data = false;\n"
+  "    if ((fst & 0x80) == 0 || (fst & 0xe0) == 0xe0) continue;\n"
+  "    else if ((fst & 0xf0) == 0x80) nb_objs = 2 * (fst & 0x0f);\n"
+  "    else if ((fst & 0xf0) == 0x90) nb_objs = fst & 0x0f;\n"
+  "    else if ((fst & 0xe0) == 0xa0) fixed = fst & 0x1f;\n"
+  "    else switch (fst) {\n"
+  "      case 0xc0: case 0xc2: case 0xc3: break;\n"
+  "      case 0xcc: case 0xd0: fixed = 1; break;\n"
+  "      case 0xcd: case 0xd1: fixed = 2; break;\n"
+  "      case 0xce: case 0xd2: case 0xca: fixed = 4; break;\n"
+  "      case 0xcf: case 0xd3: case 0xcb: fixed = 8; break;\n"
+  "      case 0xd4: fixed = 2; break;\n"
+  "      case 0xd5: fixed = 3; break;\n"
+  "      case 0xd6: fixed = 5; break;\n"
+  "      case 0xd7: fixed = 9; break;\n"
+  "      case 0xd8: fixed = 17; break;\n"
+  "      case 0xc4: case 0xd9: lenlen = 1; is_data = true; break;\n"
+  "      case 0xc5: case 0xda: lenlen = 2; is_data = true; break;\n"
+  "      case 0xc6: case 0xdb: lenlen = 4; is_data = true; break;\n"
+  "      case 0xc7: lenlen = 1; fixed = 1; is_data = true; break;\n"
+  "      case 0xc8: lenlen = 2; fixed = 1; is_data = true; break;\n"
+  "      case 0xc9: lenlen = 4; fixed = 1; is_data = true; break;\n"
+  "      case 0xdc: lenlen = 2; break;\n"
+  "      case 0xdd: lenlen = 4; break;\n"
+  "      case 0xde: lenlen = 2; break;\n"
+  "      case 0xdf: lenlen = 4; break;\n"
+  "      default: return 0;\n"
+  "    }\n"
+  "    if ((size_t)(end - p) < lenlen) return 0;\n"
+  "    if (lenlen) {\n"
+  "      uint64_t const n = mpgen_be(p, lenlen);\n"
+  "      p += lenlen;\n"
+  "      if (is_data) fixed += n;\n"
+  "      else nb_objs = fst >= 0xde ? 2 * n : n;\n"
+  "    }\n"
+  "    if ((uint64_t)(end - p) < fixed) return 0;\n"
+  "    p += fixed;\n"
+  "    pending += nb_objs;\n"
+  "  }\n"
+  "  return p - start;\n"
+  "}\n"
+  "\n"
+  "// The getters return the size of the value read, or 0 if it's not of the\n"
+  "// expected type or is truncated:\n"
+  "\n"
+  "static inline size_t mpgen_bool(unsigned char const *p, size_t len, bool *v)\n"
+  "{\n"
+  "  if (len < 1 || (p[0] != 0xc2 && p[0] != 0xc3)) return 0;\n"
+  "  *v = p[0] == 0xc3;\n"
+  "  return 1;\n"
+  "}\n"
+  "\n"
+  "static inline size_t mpgen_num(unsigned char const *p, size_t len, uint64_t *n, bool *sign)\n"
+  "{\n"
+  "  if (len < 1) return 0;\n"
+  "  unsigned char const fst = p[0];\n"
+  "  size_t w;\n"
+  "  *sign = false;\n"
+  "  if ((fst & 0x80) == 0) { *n = fst; return 1; }\n"
+  "  if ((fst & 0xe0) == 0xe0) { *n = (uint64_t)(int64_t)(signed char)fst; *sign = true; return 1; }\n"
+  "  if (fst >= 0xcc && fst <= 0xcf) w = 1 << (fst - 0xcc);\n"
+  "  else if (fst >= 0xd0 && fst <= 0xd3) { w = 1 << (fst - 0xd0); *sign = true; }\n"
+  "  else return 0;\n"
+  "  if (len < 1 + w) return 0;\n"
+  "  *n = mpgen_be(p + 1, w);\n"
+  "  if (*sign && w < 8 && (*n >> (w * 8 - 1))) *n |= ~0ULL << (w * 8);\n"
+  "  return 1 + w;\n"
+  "}\n"
+  "\n"
+  "static inline size_t mpgen_int(unsigned char const *p, size_t len, int64_t *v)\n"
+  "{\n"
+  "  uint64_t n;\n"
+  "  bool sign;\n"
+  "  size_t const sz = mpgen_num(p, len, &n, &sign);\n"
+  "  if (! sz || (! sign && n > INT64_MAX)) return 0;\n"
+  "  *v = (int64_t)n;\n"
+  "  return sz;\n"
+  "}\n"
+  "\n"
+  "static inline size_t mpgen_uint(unsigned char const *p, size_t len, uint64_t *v)\n"
+  "{\n"
+  "  bool sign;\n"
+  "  size_t const sz = mpgen_num(p, len, v, &sign);\n"
+  "  if (! sz || (sign && (int64_t)*v < 0)) return 0;\n"
+  "  return sz;\n"
+  "}\n"
+  "\n"
+  "static inline size_t mpgen_float(unsigned char const *p, size_t len, double *v)\n"
+  "{\n"
+  "  if (len >= 9 && p[0] == 0xcb) {\n"
+  "    uint64_t const b = mpgen_be(p + 1, 8);\n"
+  "    memcpy(v, &b, sizeof(*v));\n"
+  "    return 9;\n"
+  "  }\n"
+  "  if (len >= 5 && p[0] == 0xca) {\n"
+  "    uint32_t const b = mpgen_be(p + 1, 4);\n"
+  "    float f;\n"
+  "    memcpy(&f, &b, sizeof(f));\n"
+  "    *v = f;\n"
+  "    return 5;\n"
+  "  }\n"
+  "  uint64_t n;\n"
+  "  bool sign;\n"
+  "  size_t const sz = mpgen_num(p, len, &n, &sign);\n"
+  "  if (sz) *v = sign ? (double)(int64_t)n : (double)n;\n"
+  "  return sz;\n"
+  "}\n"
+  "\n"
+  "static inline size_t mpgen_data(unsigned char const *p, size_t len, struct mpgen_data *v, bool is_str)\n"
+  "{\n"
+  "  if (len < 1) return 0;\n"
+  "  unsigned char const fst = p[0];\n"
+  "  size_t hdr_len;\n"
+  "  uint64_t n;\n"
+  "  if (is_str && (fst & 0xe0) == 0xa0) {\n"
+  "    hdr_len = 1;\n"
+  "    n = fst & 0x1f;\n"
+  "  } else {\n"
+  "    unsigned char const base = is_str ? 0xd9 : 0xc4;\n"
+  "    if (fst < base || fst > base + 2) return 0;\n"
+  "    hdr_len = 1 + (1 << (fst - base));\n"
+  "    if (len < hdr_len) return 0;\n"
+  "    n = mpgen_be(p + 1, hdr_len - 1);\n"
+  "  }\n"
+  "  if (len - hdr_len < n) return 0;\n"
+  "  v->ptr = (char const *)p + hdr_len;\n"
+  "  v->len = n;\n"
+  "  return hdr_len + n;\n"
+  "}\n"
+  "\n"
+  "static inline size_t mpgen_str(unsigned char const *p, size_t len, struct mpgen_data *v)\n"
+  "{\n"
+  "  return mpgen_data(p, len, v, true);\n"
+  "}\n"
+  "\n"
+  "static inline size_t mpgen_bin(unsigned char const *p, size_t len, struct mpgen_data *v)\n"
+  "{\n"
+  "  return mpgen_data(p, len, v, false);\n"
+  "}\n"
+  "\n"
+  "#endif\n";
+
+static void generate(char const *name, char const *fname, struct field const *fields, unsigned nb_fields)
+{
+  printf("/* Generated by msgpack-codegen from %s, do not edit. */\n\n", fname);
+  printf("#include <stdbool.h>\n#include <stddef.h>\n#include <stdint.h>\n#include <string.h>\n\n");
+  fputs(helpers, stdout);
+
+  // The struct:
+  printf("\nstruct %s {\n", name);
+  printf("  uint64_t present;  // bit N set if the Nth field was found\n");
+  for (unsigned i = 0; i < nb_fields; i++) {
+    if (0 != strcmp(fields[i].key, fields[i].cname)) printf("  // %s\n", fields[i].key);
+    printf(types[fields[i].type].decl, fields[i].cname);
+  }
+  printf("};\n\n");
+  for (unsigned i = 0; i < nb_fields; i++) {
+    char *upper = strdup(fields[i].cname);
+    for (char *c = upper; *c; c++) *c = toupper((unsigned char)*c);
+    printf("#define %s_HAS_%s (1ULL << %u)\n", name, upper, i);
+    free(upper);
+  }
+  uint64_t const all = nb_fields == 64 ? ~0ULL : (1ULL << nb_fields) - 1;
+  printf("#define %s_HAS_ALL 0x%llxULL\n", name, (unsigned long long)all);
+
+  // Generic decoder:
+  printf(
+    "\n"
+    "static size_t %s_decode_generic(unsigned char const *buf, size_t len, struct %s *rec)\n"
+    "{\n"
+    "  unsigned char const *p = buf, *const end = buf + len;\n"
+    "  uint64_t nb;\n"
+    "  if (len < 1) return 0;\n"
+    "  if ((p[0] & 0xf0) == 0x80) {\n"
+    "    nb = p[0] & 0x0f;\n"
+    "    p += 1;\n"
+    "  } else if ((p[0] == 0xde && len >= 3) || (p[0] == 0xdf && len >= 5)) {\n"
+    "    size_t const lenlen = p[0] == 0xde ? 2 : 4;\n"
+    "    nb = mpgen_be(p + 1, lenlen);\n"
+    "    p += 1 + lenlen;\n"
+    "  } else {\n"
+    "    return 0;\n"
+    "  }\n"
+    "  rec->present = 0;\n"
+    "  for (; nb > 0; nb--) {\n"
+    "    struct mpgen_data k;\n"
+    "    size_t n = mpgen_str(p, end - p, &k);\n"
+    "    if (! n) {\n"
+    "      // Not a str key, matching no field:\n"
+    "      if (! (n = mpgen_skip(p, end - p))) return 0;\n"
+    "      k.len = (size_t)-1;\n"
+    "    }\n"
+    "    p += n;\n",
+    name, name);
+  for (unsigned i = 0; i < nb_fields; i++) {
+    struct field const *f = fields + i;
+    size_t const klen = strlen(f->key);
+    printf("    if (k.len == %zu && 0 == memcmp(k.ptr, ", klen);
+    print_literal((unsigned char const *)f->key, klen);
+    printf(", %zu) && (n = %s(p, end - p, &rec->%s))) {\n", klen, types[f->type].getter, f->cname);
+    printf("      rec->present |= 1ULL << %u;\n", i);
+    printf("      p += n;\n");
+    printf("      continue;\n");
+    printf("    }\n");
+  }
+  printf(
+    "    // Unknown key, or value of the wrong type:\n"
+    "    if (! (n = mpgen_skip(p, end - p))) return 0;\n"
+    "    p += n;\n"
+    "  }\n"
+    "  return p - buf;\n"
+    "}\n");
+
+  // Fast path:
+  printf(
+    "\n"
+    "// Decode the map at the start of buf into rec, and return its size, or 0\n"
+    "// if it's malformed or truncated. Fields that are missing or of the wrong\n"
+    "// type are not set in rec->present.\n"
+    "static inline size_t %s_decode(unsigned char const *buf, size_t len, struct %s *rec)\n"
+    "{\n"
+    "  unsigned char const *p = buf, *const end = buf + len;\n"
+    "  size_t n;\n"
+    "  (void)n;\n",
+    name, name);
+  unsigned char hdr[3];
+  size_t hdr_len;
+  if (nb_fields < 16) {
+    hdr[0] = 0x80 | nb_fields;
+    hdr_len = 1;
+  } else {
+    hdr[0] = 0xde;
+    hdr[1] = nb_fields >> 8;
+    hdr[2] = nb_fields;
+    hdr_len = 3;
+  }
+  printf("  if (len < %zu || memcmp(p, ", hdr_len);
+  print_literal(hdr, hdr_len);
+  printf(", %zu)) goto generic;\n", hdr_len);
+  printf("  p += %zu;\n", hdr_len);
+  for (unsigned i = 0; i < nb_fields; i++) {
+    struct field const *f = fields + i;
+    printf("  // %s\n", f->key);
+    size_t const klen = strlen(f->key) + (strlen(f->key) < 32 ? 1 : strlen(f->key) < 256 ? 2 : 3);
+    printf("  if ((size_t)(end - p) < %zu || memcmp(p, ", klen);
+    print_raw_key(f->key);
+    printf(", %zu)) goto generic;\n", klen);
+    printf("  p += %zu;\n", klen);
+    if (f->type == T_FLOAT) {
+      // The usual encoding of a double, inline:
+      printf("  if (end - p < 9 || p[0] != 0xcb) goto generic;\n");
+      printf("  { uint64_t const b = mpgen_be(p + 1, 8); memcpy(&rec->%s, &b, sizeof(double)); }\n", f->cname);
+      printf("  p += 9;\n");
+    } else {
+      printf("  if (! (n = %s(p, end - p, &rec->%s))) goto generic;\n", types[f->type].getter, f->cname);
+      printf("  p += n;\n");
+    }
+  }
+  printf(
+    "  rec->present = %s_HAS_ALL;\n"
+    "  return p - buf;\n"
+    "generic:\n"
+    "  return %s_decode_generic(buf, len, rec);\n"
+    "}\n",
+    name, name);
+}
+
+static void usage(char const *progname)
+{
+  fprintf(stderr, "%s [-n|--name NAME] schema\n", progname);
+}
+
+int main(int nb_args, char **args)
+{
+  char const *name = "record";
+
+  static struct option const options[] = {
+    { "name", required_argument, NULL, 'n' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 },
+  };
+  int opt;
+  while (-1 != (opt = getopt_long(nb_args, args, "n:h", options, NULL))) {
+    switch (opt) {
+      case 'n':
+        name = optarg;
+        break;
+      case 'h':
+        usage(args[0]);
+        return 0;
+      default:
+        usage(args[0]);
+        return 1;
+    }
+  }
+  if (optind != nb_args - 1) {
+    usage(args[0]);
+    return 1;
+  }
+  char const *fname = args[optind];
+
+  FILE *f = fopen(fname, "r");
+  if (! f) {
+    fprintf(stderr, "Cannot open schema file '%s': %s\n", fname, strerror(errno));
+    return 1;
+  }
+  static struct field fields[MAX_FIELDS];
+  unsigned const nb_fields = read_schema(f, fname, fields);
+  fclose(f);
+
+  generate(name, fname, fields, nb_fields);
+
+  for (unsigned i = 0; i < nb_fields; i++) {
+    free(fields[i].key);
+    free(fields[i].cname);
+  }
+  return 0;
+}
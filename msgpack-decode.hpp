@@ -0,0 +1,270 @@
+/*
+ * Header only C++17 msgpack decoder.
+ *
+ * Same decoding as msgpack-dump, but calling a visitor instead of printing:
+ *
+ *   struct my_visitor : msgpack_dump::visitor {
+ *     void str(std::string_view s) { ... }
+ *   };
+ *   my_visitor v;
+ *   auto res = msgpack_dump::decode(msgpack_dump::span<std::byte const>(buf, len), v);
+ *
+ * decode() visits one value and reports how many bytes it consumed. Strings,
+ * bins and ext payloads are passed as views into the input buffer; nothing
+ * is allocated.
+ */
+#ifndef MSGPACK_DECODE_HPP
+#define MSGPACK_DECODE_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace msgpack_dump {
+
+// Minimal std::span replacement, which is C++20:
+template<class T>
+class span {
+  T *ptr_;
+  std::size_t size_;
+public:
+  constexpr span() noexcept : ptr_(nullptr), size_(0) {}
+  constexpr span(T *ptr, std::size_t size) noexcept : ptr_(ptr), size_(size) {}
+  constexpr T *data() const noexcept { return ptr_; }
+  constexpr std::size_t size() const noexcept { return size_; }
+  constexpr T *begin() const noexcept { return ptr_; }
+  constexpr T *end() const noexcept { return ptr_ + size_; }
+  constexpr span subspan(std::size_t off) const noexcept { return span(ptr_ + off, size_ - off); }
+};
+
+// Visitors may inherit this and override only what they need.
+struct visitor {
+  void nil() {}
+  void boolean(bool) {}
+  void integer(std::int64_t) {}
+  void uinteger(std::uint64_t) {}
+  void floating(double) {}
+  void str(std::string_view) {}
+  void bin(std::string_view) {}
+  void ext(std::int8_t /* type */, std::string_view) {}
+  void array_begin(std::uint32_t /* nb_objs */) {}
+  void array_end() {}
+  // Maps items are visited as key, value, key, value...
+  void map_begin(std::uint32_t /* nb_objs */) {}
+  void map_end() {}
+};
+
+/*
+ * Tag table
+ */
+
+enum class kind : std::uint8_t {
+  bad, nil, boolean, fixint, uint, sint, float32, float64,
+  str, bin, array, map, ext,
+};
+
+struct tag_info {
+  kind k;
+  // Size of the value (for numbers) or of the length field that follows:
+  std::uint8_t lenlen;
+  // Length encoded in the tag itself (fix* types), or fixext payload size,
+  // or the boolean value:
+  std::uint8_t fixlen;
+};
+
+constexpr std::array<tag_info, 256> make_tag_table()
+{
+  std::array<tag_info, 256> t {};
+  for (unsigned fst = 0; fst < 256; fst++) {
+    tag_info &i = t[fst];
+    i = tag_info { kind::bad, 0, 0 };
+    if ((fst & 0x80) == 0 || (fst & 0xe0) == 0xe0) i = { kind::fixint, 0, 0 };
+    else if ((fst & 0xf0) == 0x80) i = { kind::map, 0, std::uint8_t(fst & 0x0f) };
+    else if ((fst & 0xf0) == 0x90) i = { kind::array, 0, std::uint8_t(fst & 0x0f) };
+    else if ((fst & 0xe0) == 0xa0) i = { kind::str, 0, std::uint8_t(fst & 0x1f) };
+  }
+  t[0xc0] = { kind::nil, 0, 0 };
+  t[0xc2] = { kind::boolean, 0, 0 };
+  t[0xc3] = { kind::boolean, 0, 1 };
+  t[0xc4] = { kind::bin, 1, 0 };
+  t[0xc5] = { kind::bin, 2, 0 };
+  t[0xc6] = { kind::bin, 4, 0 };
+  t[0xc7] = { kind::ext, 1, 0 };
+  t[0xc8] = { kind::ext, 2, 0 };
+  t[0xc9] = { kind::ext, 4, 0 };
+  t[0xca] = { kind::float32, 4, 0 };
+  t[0xcb] = { kind::float64, 8, 0 };
+  t[0xcc] = { kind::uint, 1, 0 };
+  t[0xcd] = { kind::uint, 2, 0 };
+  t[0xce] = { kind::uint, 4, 0 };
+  t[0xcf] = { kind::uint, 8, 0 };
+  t[0xd0] = { kind::sint, 1, 0 };
+  t[0xd1] = { kind::sint, 2, 0 };
+  t[0xd2] = { kind::sint, 4, 0 };
+  t[0xd3] = { kind::sint, 8, 0 };
+  t[0xd4] = { kind::ext, 0, 1 };
+  t[0xd5] = { kind::ext, 0, 2 };
+  t[0xd6] = { kind::ext, 0, 4 };
+  t[0xd7] = { kind::ext, 0, 8 };
+  t[0xd8] = { kind::ext, 0, 16 };
+  t[0xd9] = { kind::str, 1, 0 };
+  t[0xda] = { kind::str, 2, 0 };
+  t[0xdb] = { kind::str, 4, 0 };
+  t[0xdc] = { kind::array, 2, 0 };
+  t[0xdd] = { kind::array, 4, 0 };
+  t[0xde] = { kind::map, 2, 0 };
+  t[0xdf] = { kind::map, 4, 0 };
+  return t;
+}
+
+inline constexpr std::array<tag_info, 256> tag_table = make_tag_table();
+
+/*
+ * Decoder
+ */
+
+enum class errc : std::uint8_t { ok, truncated, bad_tag, too_deep };
+
+struct result {
+  std::size_t consumed;
+  errc err;
+  constexpr explicit operator bool() const noexcept { return err == errc::ok; }
+};
+
+// Nesting deeper than this is reported as an error rather than risking a
+// stack overflow:
+constexpr unsigned max_depth = 1000;
+
+namespace detail {
+
+// Big endian is not dead:
+inline std::uint64_t load_be(std::byte const *p, unsigned len) noexcept
+{
+  std::uint64_t n = 0;
+  for (unsigned i = 0; i < len; i++) n = (n << 8) | std::uint64_t(p[i]);
+  return n;
+}
+
+template<class Visitor>
+class decoder {
+  std::byte const *p_;
+  std::byte const *const end_;
+  Visitor &v_;
+
+  bool need(std::uint64_t sz) const noexcept
+  {
+    return std::uint64_t(end_ - p_) >= sz;
+  }
+
+  std::string_view view(std::size_t len) noexcept
+  {
+    std::string_view s(reinterpret_cast<char const *>(p_), len);
+    p_ += len;
+    return s;
+  }
+
+public:
+  decoder(span<std::byte const> buf, Visitor &v) noexcept :
+    p_(buf.data()), end_(buf.data() + buf.size()), v_(v) {}
+
+  std::size_t consumed(span<std::byte const> buf) const noexcept
+  {
+    return p_ - buf.data();
+  }
+
+  errc value(unsigned depth) noexcept
+  {
+    if (depth >= max_depth) return errc::too_deep;
+    if (! need(1)) return errc::truncated;
+    unsigned char const fst = static_cast<unsigned char>(*p_++);
+    tag_info const &ti = tag_table[fst];
+
+    if (! need(ti.lenlen)) return errc::truncated;
+    std::uint64_t const n = ti.lenlen ? load_be(p_, ti.lenlen) : ti.fixlen;
+    p_ += ti.lenlen;
+
+    switch (ti.k) {
+      case kind::bad:
+        return errc::bad_tag;
+      case kind::nil:
+        v_.nil();
+        break;
+      case kind::boolean:
+        v_.boolean(n != 0);
+        break;
+      case kind::fixint:
+        if (fst & 0x80) v_.integer(std::int8_t(fst));
+        else v_.uinteger(fst);
+        break;
+      case kind::uint:
+        v_.uinteger(n);
+        break;
+      case kind::sint: {
+        unsigned const bits = ti.lenlen * 8;
+        std::uint64_t s = n;
+        if (bits < 64 && (n >> (bits - 1))) s |= ~0ULL << bits;
+        v_.integer(std::int64_t(s));
+        break;
+      }
+      case kind::float32: {
+        std::uint32_t const b = std::uint32_t(n);
+        float f;
+        std::memcpy(&f, &b, sizeof(f));
+        v_.floating(f);
+        break;
+      }
+      case kind::float64: {
+        double d;
+        std::memcpy(&d, &n, sizeof(d));
+        v_.floating(d);
+        break;
+      }
+      case kind::str:
+        if (! need(n)) return errc::truncated;
+        v_.str(view(n));
+        break;
+      case kind::bin:
+        if (! need(n)) return errc::truncated;
+        v_.bin(view(n));
+        break;
+      case kind::ext: {
+        if (! need(1 + n)) return errc::truncated;
+        std::int8_t const type = std::int8_t(*p_++);
+        v_.ext(type, view(n));
+        break;
+      }
+      case kind::array:
+        v_.array_begin(std::uint32_t(n));
+        for (std::uint64_t i = 0; i < n; i++) {
+          if (errc e = value(depth + 1); e != errc::ok) return e;
+        }
+        v_.array_end();
+        break;
+      case kind::map:
+        v_.map_begin(std::uint32_t(n));
+        for (std::uint64_t i = 0; i < 2 * n; i++) {
+          if (errc e = value(depth + 1); e != errc::ok) return e;
+        }
+        v_.map_end();
+        break;
+    }
+    return errc::ok;
+  }
+};
+
+}  // namespace detail
+
+// Visit the first value of buf.
+template<class Visitor>
+result decode(span<std::byte const> buf, Visitor &v) noexcept
+{
+  detail::decoder<Visitor> d(buf, v);
+  errc const err = d.value(0);
+  return result { d.consumed(buf), err };
+}
+
+}  // namespace msgpack_dump
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * Decoders of msgpack extension types, for msgpack-dump.
+ *
+ * msgpack-dump prints extension payloads it has no decoder for as hex
+ * dumps. A decoder turns a payload into text instead, which is then printed
+ * the way the output mode prints values (as a JSON string in JSON, for
+ * instance).
+ *
+ * Decoders are either compiled in or come from plugins: shared objects
+ * found in the directory given with --ext-plugins, each exporting
+ * msgpack_dump_ext_init. For instance, for a type 5 holding an unsigned
+ * number of thousandths on 4 bytes:
+ *
+ *   #include <stdint.h>
+ *   #include "msgpack-dump-ext.h"
+ *
+ *   static struct msgpack_dump_ext_host const *host;
+ *
+ *   static bool milli(int type, unsigned char const *data, size_t len)
+ *   {
+ *     (void)type;
+ *     if (len != 4) return false;
+ *     uint32_t v = (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+ *     host->printf("%u.%03u", v / 1000, v % 1000);
+ *     return true;
+ *   }
+ *
+ *   bool msgpack_dump_ext_init(struct msgpack_dump_ext_host const *h)
+ *   {
+ *     if (h->version != MSGPACK_DUMP_EXT_VERSION) return false;
+ *     host = h;
+ *     host->add_decoder(5, "milli", milli);
+ *     return true;
+ *   }
+ *
+ * built with: cc -shared -fPIC -o milli.so milli.c
+ */
+#ifndef MSGPACK_DUMP_EXT_H
+#define MSGPACK_DUMP_EXT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define MSGPACK_DUMP_EXT_VERSION 1
+
+/* Decodes the len bytes of a payload of the given type (-128 to 127),
+ * writing its text through the host. Returns false if that payload cannot
+ * be decoded, in which case what was written is dropped and the payload is
+ * hex dumped. */
+typedef bool msgpack_dump_ext_decoder(int type, unsigned char const *data, size_t len);
+
+struct msgpack_dump_ext_host {
+  unsigned version;
+  void (*write)(char const *data, size_t len);
+  void (*printf)(char const *fmt, ...) __attribute__((format(printf, 1, 2)));
+  // Later additions for the same type replace earlier ones:
+  void (*add_decoder)(int type, char const *name, msgpack_dump_ext_decoder *decode);
+};
+
+/* Exported by plugins and called once they are loaded. Returns false if
+ * the plugin cannot work with this host. */
+bool msgpack_dump_ext_init(struct msgpack_dump_ext_host const *host);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -10,351 +11,3731 @@
 #include <errno.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <math.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <stddef.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
+#include "msgpack-dump-ext.h"
+
+#define IBUF_SIZE (64 * 1024)
 
 struct ctx {
-  int fd;
-  size_t offset;
+  int fd;  // <0 when decoding from memory
+  size_t offset;  // Number of bytes consumed so far
   unsigned indent;
   bool eof;
+  // Input buffer: bytes from ipos to ilen are read but not consumed yet:
+  unsigned char *ibuf;
+  size_t ipos, ilen;
+};
+
+static bool ctx_ctor(struct ctx *ctx, int fd)
+{
+  ctx->fd = fd;
+  ctx->offset = 0;
+  ctx->indent = 0;
+  ctx->eof = false;
+  ctx->ipos = ctx->ilen = 0;
+  ctx->ibuf = malloc(IBUF_SIZE);
+  if (! ctx->ibuf) {
+    fprintf(stderr, "Cannot alloc %d bytes", IBUF_SIZE);
+    return false;
+  }
+  return true;
+}
+
+// Decode from memory instead of a file; data is used as the input buffer.
+static void ctx_ctor_mem(struct ctx *ctx, unsigned char const *data, size_t size)
+{
+  ctx->fd = -1;
+  ctx->offset = 0;
+  ctx->indent = 0;
+  ctx->eof = false;
+  ctx->ipos = 0;
+  ctx->ilen = size;
+  ctx->ibuf = (unsigned char *)data;
+}
+
+// Move to the given offset of the data of a memory context.
+static void ctx_seek_mem(struct ctx *ctx, size_t offset)
+{
+  assert(ctx->fd < 0 && offset <= ctx->ilen);
+  ctx->ipos = ctx->offset = offset;
+  ctx->eof = false;
+}
+
+static void ctx_dtor(struct ctx *ctx)
+{
+  if (ctx->fd >= 0) free(ctx->ibuf);
+  ctx->ibuf = NULL;
+}
+
+#define ROLE_NONE -1
+#define ROLE_MAP_KEY -2
+#define ROLE_MAP_VALUE -3
+#define ROLE_INLINE -4  // Within a one-line array
+// >=0 roles are array indexes
+
+/*
+ * Periodic reports
+ *
+ * Signal handlers only count seconds or record that a report was asked
+ * for; reports are printed between records.
+ */
+
+static volatile sig_atomic_t ticks;  // Seconds, counted when some report is periodic
+static volatile sig_atomic_t progress_asked;  // By SIGUSR1
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void on_alarm(int sig)
+{
+  (void)sig;
+  ticks ++;
+}
+
+static void on_usr1(int sig)
+{
+  (void)sig;
+  progress_asked = 1;
+}
+
+static void on_signal(int sig, void (*handler)(int))
+{
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handler;
+  sa.sa_flags = SA_RESTART;
+  sigaction(sig, &sa, NULL);
+}
+
+static void ticks_start(void)
+{
+  static bool started = false;
+  if (started) return;
+  started = true;
+  on_signal(SIGALRM, on_alarm);
+  struct itimerval it = {
+    .it_interval = { .tv_sec = 1 },
+    .it_value = { .tv_sec = 1 },
+  };
+  setitimer(ITIMER_REAL, &it, NULL);
+}
+
+/*
+ * Profiling
+ *
+ * When built with PROFILE defined (make PROFILE=1), values and bytes are
+ * counted per tag, and calls, bytes and time per IO phase, and all this is
+ * printed at exit. Otherwise the PROF_* macros compile to nothing.
+ */
+
+#ifdef PROFILE
+
+enum prof_phase { PROF_READ, PROF_WRITE, PROF_EREAD, NB_PROF_PHASES };
+
+static struct profile {
+  uint64_t start;
+  uint64_t values[256], bytes[256];  // per tag
+  struct prof_phase_counts {
+    uint64_t calls, bytes, ns;
+  } phases[NB_PROF_PHASES];
+} profile;
+
+static char const *prof_tag_name(unsigned fst)
+{
+  static char const *const names[] = {
+    [0xc0] = "nil", [0xc2] = "false", [0xc3] = "true",
+    [0xc4] = "bin8", [0xc5] = "bin16", [0xc6] = "bin32",
+    [0xc7] = "ext8", [0xc8] = "ext16", [0xc9] = "ext32",
+    [0xca] = "float32", [0xcb] = "float64",
+    [0xcc] = "uint8", [0xcd] = "uint16", [0xce] = "uint32", [0xcf] = "uint64",
+    [0xd0] = "int8", [0xd1] = "int16", [0xd2] = "int32", [0xd3] = "int64",
+    [0xd4] = "fixext1", [0xd5] = "fixext2", [0xd6] = "fixext4", [0xd7] = "fixext8", [0xd8] = "fixext16",
+    [0xd9] = "str8", [0xda] = "str16", [0xdb] = "str32",
+    [0xdc] = "array16", [0xdd] = "array32", [0xde] = "map16", [0xdf] = "map32",
+  };
+  if ((fst & 0x80) == 0) return "positive fixint";
+  if ((fst & 0xe0) == 0xe0) return "negative fixint";
+  if ((fst & 0xf0) == 0x80) return "fixmap";
+  if ((fst & 0xf0) == 0x90) return "fixarray";
+  if ((fst & 0xe0) == 0xa0) return "fixstr";
+  return names[fst] ? names[fst] : "bad";
+}
+
+// Containers are accounted for their header only:
+static void prof_value(unsigned char fst, size_t start, size_t end)
+{
+  size_t bytes = end - start;
+  if ((fst & 0xe0) == 0x80) bytes = 1;
+  else if (fst == 0xdc || fst == 0xde) bytes = 3;
+  else if (fst == 0xdd || fst == 0xdf) bytes = 5;
+  profile.values[fst] ++;
+  profile.bytes[fst] += bytes;
+}
+
+static void prof_report(void)
+{
+  uint64_t const total_ns = now_ns() - profile.start;
+  // Fix tags are reported together:
+  uint64_t values[256] = { 0 }, bytes[256] = { 0 }, nb_values = 0;
+  for (unsigned fst = 0; fst < 256; fst++) {
+    unsigned const c = (fst & 0x80) == 0 ? 0x00 : (fst & 0xe0) == 0xe0 ? 0xe0 :
+                       (fst & 0xe0) == 0x80 ? fst & 0xf0 : (fst & 0xe0) == 0xa0 ? 0xa0 : fst;
+    values[c] += profile.values[fst];
+    bytes[c] += profile.bytes[fst];
+    nb_values += profile.values[fst];
+  }
+  fprintf(stderr, "profile: %-16s %14s %8s %16s %8s\n", "tag", "values", "%", "bytes", "%");
+  uint64_t nb_bytes = 0;
+  for (unsigned c = 0; c < 256; c++) nb_bytes += bytes[c];
+  for (unsigned c = 0; c < 256; c++) {
+    if (! values[c]) continue;
+    fprintf(stderr, "profile: %-16s %14"PRIu64" %7.2f%% %16"PRIu64" %7.2f%%\n",
+            prof_tag_name(c), values[c], 100. * values[c] / nb_values,
+            bytes[c], nb_bytes ? 100. * bytes[c] / nb_bytes : 0.);
+  }
+
+  static char const *const phase_names[NB_PROF_PHASES] = {
+    [PROF_READ] = "read()", [PROF_WRITE] = "write()", [PROF_EREAD] = "eread()",
+  };
+  fprintf(stderr, "profile: %-16s %14s %16s %12s %8s\n", "phase", "calls", "bytes", "ms", "%");
+  for (unsigned p = 0; p < NB_PROF_PHASES; p++) {
+    struct prof_phase_counts const *c = profile.phases + p;
+    if (p == PROF_EREAD) {
+      // Not timed
+      fprintf(stderr, "profile: %-16s %14"PRIu64" %16"PRIu64"\n", phase_names[p], c->calls, c->bytes);
+      continue;
+    }
+    fprintf(stderr, "profile: %-16s %14"PRIu64" %16"PRIu64" %12.1f %7.2f%%\n",
+            phase_names[p], c->calls, c->bytes, c->ns / 1e6, total_ns ? 100. * c->ns / total_ns : 0.);
+  }
+  uint64_t const io_ns = profile.phases[PROF_READ].ns + profile.phases[PROF_WRITE].ns;
+  fprintf(stderr, "profile: %-16s %14s %16s %12.1f %7.2f%%\n",
+          "decode+format", "", "", (total_ns - io_ns) / 1e6, total_ns ? 100. * (total_ns - io_ns) / total_ns : 0.);
+}
+
+static void prof_ctor(void)
+{
+  profile.start = now_ns();
+  atexit(prof_report);
+}
+
+# define PROF_CTOR() prof_ctor()
+# define PROF_DECL(decl) decl
+// Count nb values with that tag, totalling that many bytes:
+# define PROF_VALUES(fst, nb, sz) do { profile.values[fst] += (nb); profile.bytes[fst] += (sz); } while (0)
+// A value read by dump(), from start to end offsets:
+# define PROF_VALUE(fst, start, end) prof_value(fst, start, end)
+# define PROF_START(v) uint64_t const v = now_ns()
+# define PROF_STOP(phase, v, sz) do { \
+    profile.phases[phase].calls ++; \
+    profile.phases[phase].bytes += (sz) > 0 ? (sz) : 0; \
+    profile.phases[phase].ns += now_ns() - (v); \
+  } while (0)
+// Counts only, for calls that are too frequent to be timed:
+# define PROF_COUNT(phase, sz) do { profile.phases[phase].calls ++; profile.phases[phase].bytes += (sz); } while (0)
+
+#else
+
+# define PROF_CTOR() ((void)0)
+# define PROF_DECL(decl)
+# define PROF_VALUES(fst, nb, sz) ((void)0)
+# define PROF_VALUE(fst, start, end) ((void)0)
+# define PROF_START(v)
+# define PROF_STOP(phase, v, sz) ((void)0)
+# define PROF_COUNT(phase, sz) ((void)0)
+
+#endif
+
+/*
+ * Hardware counters
+ *
+ * With --perf-counters, some CPU counters are read through perf_event_open
+ * and reported at exit. With --perf-counters=phases they are also read
+ * around every read() and write(), to tell those phases apart from the
+ * decoding (which includes formatting, as both are interleaved). Events
+ * that cannot be opened are just not reported.
+ */
+
+static struct perf_event_desc {
+  char const *name;
+  uint32_t type;
+  uint64_t config;
+} const perf_events[] = {
+  { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { "L1D-read-misses", PERF_TYPE_HW_CACHE,
+    PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+
+#define NB_PERF_EVENTS (sizeof(perf_events)/sizeof(perf_events[0]))
+
+enum perf_phase { PERF_READ, PERF_WRITE, NB_PERF_PHASES };
+
+static struct perf {
+  bool enabled, phases;
+  bool user_only;  // If the kernel could not be measured
+  int leader;  // The events are read as a group through this one
+  unsigned nb_open;
+  int idx[NB_PERF_EVENTS];  // Position of each event in the group, or -1
+  uint64_t before[NB_PERF_EVENTS];
+  uint64_t phases_counts[NB_PERF_PHASES][NB_PERF_EVENTS];
+} perf = { .leader = -1 };
+
+static int perf_open(struct perf_event_desc const *e, int group, bool user_only)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = e->type;
+  attr.config = e->config;
+  attr.disabled = group < 0;
+  attr.exclude_kernel = user_only;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+// Read the current (unscaled) values, 0 for missing events. Returns the
+// scaling factor due to multiplexing, or 0 on error.
+static double perf_read(uint64_t *vals)
+{
+  uint64_t buf[3 + NB_PERF_EVENTS];
+  ssize_t const want = (3 + perf.nb_open) * sizeof(uint64_t);
+  if (read(perf.leader, buf, sizeof(buf)) < want) return 0;
+  for (unsigned e = 0; e < NB_PERF_EVENTS; e++) {
+    vals[e] = perf.idx[e] >= 0 ? buf[3 + perf.idx[e]] : 0;
+  }
+  return buf[2] > 0 ? (double)buf[1] / buf[2] : 0;
+}
+
+static inline void perf_phase_start(void)
+{
+  if (perf.phases) (void)perf_read(perf.before);
+}
+
+static inline void perf_phase_stop(enum perf_phase phase)
+{
+  if (! perf.phases) return;
+  uint64_t after[NB_PERF_EVENTS];
+  if (perf_read(after) == 0) return;
+  for (unsigned e = 0; e < NB_PERF_EVENTS; e++) {
+    perf.phases_counts[phase][e] += after[e] - perf.before[e];
+  }
+}
+
+static void perf_report(void)
+{
+  uint64_t vals[NB_PERF_EVENTS];
+  ioctl(perf.leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  double const scale = perf_read(vals);
+  if (scale == 0) {
+    fprintf(stderr, "perf: cannot read counters\n");
+    return;
+  }
+  if (scale > 1.01) fprintf(stderr, "perf: counters were multiplexed, values are scaled by %.2f\n", scale);
+  if (perf.user_only) fprintf(stderr, "perf: kernel not measured (see /proc/sys/kernel/perf_event_paranoid)\n");
+
+  if (perf.phases) {
+    fprintf(stderr, "perf: %-16s %16s %16s %16s %16s\n", "", "total", "read", "write", "decode");
+  }
+  for (unsigned e = 0; e < NB_PERF_EVENTS; e++) {
+    if (perf.idx[e] < 0) {
+      fprintf(stderr, "perf: %-16s %16s\n", perf_events[e].name, "n/a");
+      continue;
+    }
+    fprintf(stderr, "perf: %-16s %16.0f", perf_events[e].name, vals[e] * scale);
+    if (perf.phases) {
+      uint64_t const r = perf.phases_counts[PERF_READ][e], w = perf.phases_counts[PERF_WRITE][e];
+      fprintf(stderr, " %16.0f %16.0f %16.0f", r * scale, w * scale, (vals[e] - r - w) * scale);
+    }
+    fprintf(stderr, "\n");
+  }
+  if (perf.idx[0] >= 0 && perf.idx[1] >= 0 && vals[0] > 0) {
+    fprintf(stderr, "perf: %.2f instructions per cycle", (double)vals[1] / vals[0]);
+    if (perf.idx[2] >= 0 && vals[1] > 0) {
+      fprintf(stderr, ", %.2f branch misses per 1000 instructions", 1000. * vals[2] / vals[1]);
+    }
+    fprintf(stderr, "\n");
+  }
+}
+
+static void perf_ctor(void)
+{
+  for (unsigned e = 0; e < NB_PERF_EVENTS; e++) perf.idx[e] = -1;
+
+  int err = 0;
+  for (unsigned e = 0; e < NB_PERF_EVENTS; e++) {
+    int fd = perf_open(perf_events + e, perf.leader, perf.user_only);
+    if (fd < 0 && perf.leader < 0 && ! perf.user_only && (errno == EACCES || errno == EPERM)) {
+      // Not allowed to look at the kernel, retry with user space only:
+      perf.user_only = true;
+      fd = perf_open(perf_events + e, perf.leader, perf.user_only);
+    }
+    if (fd < 0) {
+      err = errno;
+      continue;
+    }
+    if (perf.leader < 0) perf.leader = fd;
+    perf.idx[e] = perf.nb_open ++;
+  }
+
+  if (perf.leader < 0) {
+    fprintf(stderr, "perf: cannot open hardware counters: %s\n", strerror(err));
+    perf.enabled = perf.phases = false;
+    return;
+  }
+  atexit(perf_report);
+  ioctl(perf.leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(perf.leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/*
+ * Statistics
+ *
+ * With --stats-stderr, the amount of data read and written, and the time
+ * spent blocked reading and writing it, are reported on stderr at exit (and
+ * every few seconds if asked to). The rest of the time is spent decoding
+ * and formatting.
+ */
+
+static struct stats {
+  bool enabled;
+  unsigned interval;  // Seconds between reports, 0 to report at exit only
+  sig_atomic_t next;  // Tick of the next report
+  double start;
+  uint64_t bytes_in, bytes_out, records;
+  double read_time, write_time;
+} stats;
+
+static ssize_t do_read(int fd, void *buf, size_t sz)
+{
+  PROF_START(prof_start);
+  ssize_t ret;
+  if (! stats.enabled && ! perf.phases) {
+    ret = read(fd, buf, sz);
+  } else {
+    double const start = now();
+    perf_phase_start();
+    ret = read(fd, buf, sz);
+    perf_phase_stop(PERF_READ);
+    stats.read_time += now() - start;
+    if (ret > 0) stats.bytes_in += ret;
+  }
+  PROF_STOP(PROF_READ, prof_start, ret);
+  return ret;
+}
+
+static ssize_t do_write(int fd, void const *buf, size_t sz)
+{
+  PROF_START(prof_start);
+  ssize_t ret;
+  if (! stats.enabled && ! perf.phases) {
+    ret = write(fd, buf, sz);
+  } else {
+    double const start = now();
+    perf_phase_start();
+    ret = write(fd, buf, sz);
+    perf_phase_stop(PERF_WRITE);
+    stats.write_time += now() - start;
+    if (ret > 0) stats.bytes_out += ret;
+  }
+  PROF_STOP(PROF_WRITE, prof_start, ret);
+  return ret;
+}
+
+static void stats_report(void)
+{
+  double const elapsed = now() - stats.start;
+  double const decode_time = elapsed - stats.read_time - stats.write_time;
+  double const pct = elapsed > 0 ? 100. / elapsed : 0;
+  double const rate = elapsed > 0 ? 1. / elapsed : 0;
+  struct rusage ru;
+  long maxrss = getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : -1;
+  fprintf(stderr,
+    "stats: %.1fs, %"PRIu64" bytes in (%.1f MB/s), %"PRIu64" bytes out (%.1f MB/s), "
+    "%"PRIu64" records (%.0f/s)\n"
+    "stats: read %.2fs (%.0f%%), write %.2fs (%.0f%%), decode %.2fs (%.0f%%), max RSS %ld KiB\n",
+    elapsed, stats.bytes_in, stats.bytes_in * rate / 1e6, stats.bytes_out, stats.bytes_out * rate / 1e6,
+    stats.records, stats.records * rate,
+    stats.read_time, stats.read_time * pct, stats.write_time, stats.write_time * pct,
+    decode_time, decode_time * pct, maxrss);
+}
+
+// To be called between records:
+static inline void stats_tick(void)
+{
+  stats.records ++;
+  if (stats.interval && ticks >= stats.next) {
+    stats.next = ticks + stats.interval;
+    stats_report();
+  }
+}
+
+static void stats_ctor(void)
+{
+  stats.enabled = true;
+  stats.start = now();
+  atexit(stats_report);
+  if (stats.interval > 0) {
+    stats.next = stats.interval;
+    ticks_start();
+  }
+}
+
+/*
+ * Progress
+ *
+ * On SIGUSR1, and every few seconds with --progress, tells how far in the
+ * input we are.
+ */
+
+static struct progress {
+  unsigned interval;  // 0 to report only when asked
+  sig_atomic_t next;
+  uint64_t size;  // Of the input, 0 if unknown
+  double start;
+} progress;
+
+static void progress_report(struct ctx const *ctx)
+{
+  double const elapsed = now() - progress.start;
+  double const rate = elapsed > 0 ? ctx->offset / elapsed : 0;
+  if (progress.size > 0 && progress.size >= ctx->offset) {
+    double const eta = rate > 0 ? (progress.size - ctx->offset) / rate : 0;
+    unsigned const secs = eta < UINT_MAX ? (unsigned)eta : UINT_MAX;
+    fprintf(stderr, "progress: offset %zu of %"PRIu64" (%.1f%%), %.1f MB/s, ETA %u:%02u:%02u\n",
+            ctx->offset, progress.size, 100. * ctx->offset / progress.size, rate / 1e6,
+            secs / 3600, secs / 60 % 60, secs % 60);
+  } else {
+    fprintf(stderr, "progress: offset %zu, %.1f MB/s\n", ctx->offset, rate / 1e6);
+  }
+}
+
+// To be called between records:
+static inline void progress_tick(struct ctx const *ctx)
+{
+  if (progress_asked || (progress.interval && ticks >= progress.next)) {
+    progress_asked = 0;
+    if (progress.interval) progress.next = ticks + progress.interval;
+    progress_report(ctx);
+  }
+}
+
+static void progress_ctor(int fd)
+{
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) progress.size = st.st_size;
+  progress.start = now();
+  on_signal(SIGUSR1, on_usr1);
+  if (progress.interval > 0) {
+    progress.next = progress.interval;
+    ticks_start();
+  }
+}
+
+/*
+ * Latency
+ *
+ * With --latency, the time taken by every top level value is recorded in a
+ * log-bucketed histogram: each power of 2 is split into LAT_SUB_BUCKETS
+ * buckets, so that durations are known to within 1/LAT_SUB_BUCKETS. The
+ * percentiles, and where the slowest values are in the input, are reported
+ * at exit.
+ */
+
+#define LAT_SUB_BITS 4
+#define LAT_SUB_BUCKETS (1 << LAT_SUB_BITS)
+#define LAT_NB_BUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB_BUCKETS)
+#define LAT_NB_SLOWEST 10
+
+static struct latency {
+  bool enabled;
+  uint64_t count, min, max;
+  uint64_t buckets[LAT_NB_BUCKETS];
+  // Slowest first:
+  struct slow_record {
+    uint64_t ns;
+    size_t offset;
+  } slowest[LAT_NB_SLOWEST];
+  unsigned nb_slowest;
+} latency;
+
+static unsigned lat_bucket(uint64_t ns)
+{
+  if (ns < LAT_SUB_BUCKETS) return ns;
+  unsigned const shift = 63 - __builtin_clzll(ns) - LAT_SUB_BITS;
+  return (shift + 1) * LAT_SUB_BUCKETS + (ns >> shift) - LAT_SUB_BUCKETS;
+}
+
+// Highest duration that falls in that bucket:
+static uint64_t lat_bucket_max(unsigned b)
+{
+  if (b < LAT_SUB_BUCKETS) return b;
+  unsigned const shift = b / LAT_SUB_BUCKETS - 1;
+  uint64_t const low = (uint64_t)(LAT_SUB_BUCKETS + b % LAT_SUB_BUCKETS) << shift;
+  return low + (1ULL << shift) - 1;
+}
+
+static void lat_record(uint64_t ns, size_t offset)
+{
+  if (latency.count == 0 || ns < latency.min) latency.min = ns;
+  if (ns > latency.max) latency.max = ns;
+  latency.count ++;
+  latency.buckets[lat_bucket(ns)] ++;
+
+  unsigned n = latency.nb_slowest;
+  if (n == LAT_NB_SLOWEST) {
+    if (ns <= latency.slowest[n - 1].ns) return;
+    n --;
+  } else {
+    latency.nb_slowest ++;
+  }
+  for (; n > 0 && latency.slowest[n - 1].ns < ns; n--) {
+    latency.slowest[n] = latency.slowest[n - 1];
+  }
+  latency.slowest[n].ns = ns;
+  latency.slowest[n].offset = offset;
+}
+
+static uint64_t lat_percentile(double pct)
+{
+  uint64_t const rank = (uint64_t)ceil(latency.count * pct / 100.);
+  uint64_t seen = 0;
+  for (unsigned b = 0; b < LAT_NB_BUCKETS; b++) {
+    seen += latency.buckets[b];
+    if (seen >= rank && seen > 0) {
+      uint64_t const v = lat_bucket_max(b);
+      return v < latency.max ? v : latency.max;
+    }
+  }
+  return latency.max;
+}
+
+static void latency_report(void)
+{
+  if (latency.count == 0) {
+    fprintf(stderr, "latency: no records\n");
+    return;
+  }
+  fprintf(stderr,
+    "latency: %"PRIu64" records, min %"PRIu64" ns, p50 %"PRIu64" ns, p90 %"PRIu64" ns, "
+    "p99 %"PRIu64" ns, p99.9 %"PRIu64" ns, p99.99 %"PRIu64" ns, max %"PRIu64" ns\n",
+    latency.count, latency.min, lat_percentile(50), lat_percentile(90), lat_percentile(99),
+    lat_percentile(99.9), lat_percentile(99.99), latency.max);
+  for (unsigned n = 0; n < latency.nb_slowest; n++) {
+    fprintf(stderr, "latency: %"PRIu64" ns for the record at offset %zu\n",
+            latency.slowest[n].ns, latency.slowest[n].offset);
+  }
+}
+
+/*
+ * CPU dispatch
+ *
+ * The few loops that gain from SIMD have a scalar version and, on x86,
+ * versions for wider instruction sets built with the target attribute, so
+ * that a single binary built without -march runs on any CPU. The best
+ * level the CPU supports is bound to function pointers once at startup.
+ * MSGPACK_DUMP_SIMD=scalar|sse4.2|avx2|avx512 forces a lower level, for
+ * testing.
+ */
+
+enum simd_level { SIMD_SCALAR, SIMD_SSE42, SIMD_AVX2, SIMD_AVX512, SIMD_NB_LEVELS };
+
+static char const *const simd_names[SIMD_NB_LEVELS] = {
+  [SIMD_SCALAR] = "scalar", [SIMD_SSE42] = "sse4.2", [SIMD_AVX2] = "avx2", [SIMD_AVX512] = "avx512",
+};
+
+// Best level supported by this CPU, and the one in use:
+static enum simd_level simd_best, simd_level;
+
+// Write the 2*len hex digits of src into dst:
+static void hex_scalar(char *dst, unsigned char const *src, size_t len)
+{
+  static char const hex[16] = "0123456789abcdef";
+  for (size_t n = 0; n < len; n++) {
+    *dst++ = hex[src[n] >> 4];
+    *dst++ = hex[src[n] & 15];
+  }
+}
+
+// Index of the first char that must be escaped in a JSON string, or len:
+static size_t json_scan_scalar(unsigned char const *p, size_t len)
+{
+  size_t n = 0;
+  while (n < len && p[n] >= 0x20 && p[n] != '"' && p[n] != '\\') n++;
+  return n;
+}
+
+// Byte swap nb values that were read as width (2, 4 or 8) bytes integers:
+static inline __attribute__((always_inline)) void bswap_run_body(uint64_t *vals, size_t nb, size_t width)
+{
+  switch (width) {
+    case 2: for (size_t i = 0; i < nb; i++) vals[i] = __builtin_bswap16(vals[i]); break;
+    case 4: for (size_t i = 0; i < nb; i++) vals[i] = __builtin_bswap32(vals[i]); break;
+    case 8: for (size_t i = 0; i < nb; i++) vals[i] = __builtin_bswap64(vals[i]); break;
+  }
+}
+
+static void bswap_run_scalar(uint64_t *vals, size_t nb, size_t width)
+{
+  bswap_run_body(vals, nb, width);
+}
+
+// Length of the valid UTF-8 sequence at p, or 0 if it's not valid
+// (overlong forms, surrogates and code points above U+10FFFF are not):
+static size_t utf8_seq_len(unsigned char const *p, size_t avail)
+{
+  unsigned char const c = p[0];
+  if (c < 0x80) return 1;
+  if (c < 0xc2) return 0;
+  if (c < 0xe0) return avail >= 2 && (p[1] & 0xc0) == 0x80 ? 2 : 0;
+  if (c < 0xf0) {
+    if (avail < 3 || (p[2] & 0xc0) != 0x80) return 0;
+    unsigned char const lo = c == 0xe0 ? 0xa0 : 0x80, hi = c == 0xed ? 0x9f : 0xbf;
+    return p[1] >= lo && p[1] <= hi ? 3 : 0;
+  }
+  if (c < 0xf5) {
+    if (avail < 4 || (p[2] & 0xc0) != 0x80 || (p[3] & 0xc0) != 0x80) return 0;
+    unsigned char const lo = c == 0xf0 ? 0x90 : 0x80, hi = c == 0xf4 ? 0x8f : 0xbf;
+    return p[1] >= lo && p[1] <= hi ? 4 : 0;
+  }
+  return 0;
+}
+
+// Tells if the string is valid UTF-8:
+static bool utf8_check_scalar(unsigned char const *p, size_t len)
+{
+  size_t n = 0;
+  while (n < len) {
+    if (n + 8 <= len) {
+      uint64_t v;
+      memcpy(&v, p + n, sizeof(v));
+      if (! (v & 0x8080808080808080ULL)) {
+        n += 8;
+        continue;
+      }
+    }
+    size_t const l = utf8_seq_len(p + n, len - n);
+    if (l == 0) return false;
+    n += l;
+  }
+  return true;
+}
+
+// Where SIMD validators, which check whole blocks, stopped at n, restart
+// from the lead byte of a sequence that may straddle n:
+static size_t utf8_restart(unsigned char const *p, size_t n)
+{
+  size_t k = n;
+  while (k > 0 && n - k < 3 && (p[k - 1] & 0xc0) == 0x80) k--;
+  return k > 0 && p[k - 1] >= 0xc0 ? k - 1 : n;
+}
+
+static void (*hex_kernel)(char *, unsigned char const *, size_t) = hex_scalar;
+static size_t (*json_scan)(unsigned char const *, size_t) = json_scan_scalar;
+static void (*bswap_run)(uint64_t *, size_t, size_t) = bswap_run_scalar;
+static bool (*utf8_check)(unsigned char const *, size_t) = utf8_check_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+// Ranges of chars to escape, for pcmpestri:
+static char const json_escaped_ranges[16] = { 0x00, 0x1f, '"', '"', '\\', '\\' };
+
+__attribute__((target("sse4.2")))
+static size_t json_scan_sse42(unsigned char const *p, size_t len)
+{
+  __m128i const ranges = _mm_loadu_si128((__m128i const *)json_escaped_ranges);
+  size_t n = 0;
+  for (; n + 16 <= len; n += 16) {
+    __m128i const v = _mm_loadu_si128((__m128i const *)(p + n));
+    int const i = _mm_cmpestri(ranges, 6, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+    if (i < 16) return n + i;
+  }
+  return n + json_scan_scalar(p + n, len - n);
+}
+
+__attribute__((target("avx2")))
+static size_t json_scan_avx2(unsigned char const *p, size_t len)
+{
+  __m256i const quote = _mm256_set1_epi8('"');
+  __m256i const bslash = _mm256_set1_epi8('\\');
+  __m256i const ctrl = _mm256_set1_epi8(0x1f);
+  size_t n = 0;
+  for (; n + 32 <= len; n += 32) {
+    __m256i const v = _mm256_loadu_si256((__m256i const *)(p + n));
+    __m256i const m = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bslash)),
+      _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrl), ctrl));  // v <= 0x1f
+    unsigned const mask = _mm256_movemask_epi8(m);
+    if (mask) return n + __builtin_ctz(mask);
+  }
+  return n + json_scan_scalar(p + n, len - n);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t json_scan_avx512(unsigned char const *p, size_t len)
+{
+  __m512i const quote = _mm512_set1_epi8('"');
+  __m512i const bslash = _mm512_set1_epi8('\\');
+  __m512i const ctrl = _mm512_set1_epi8(0x1f);
+  size_t n = 0;
+  for (; n + 64 <= len; n += 64) {
+    __m512i const v = _mm512_loadu_si512((void const *)(p + n));
+    __mmask64 const mask =
+      _mm512_cmpeq_epi8_mask(v, quote) | _mm512_cmpeq_epi8_mask(v, bslash) |
+      _mm512_cmple_epu8_mask(v, ctrl);
+    if (mask) return n + __builtin_ctzll(mask);
+  }
+  return n + json_scan_avx2(p + n, len - n);
+}
+
+// Nibbles are looked up with pshufb, then high and low digits interleaved:
+__attribute__((target("sse4.2")))
+static void hex_sse42(char *dst, unsigned char const *src, size_t len)
+{
+  __m128i const digits = _mm_loadu_si128((__m128i const *)"0123456789abcdef");
+  __m128i const low4 = _mm_set1_epi8(0x0f);
+  size_t n = 0;
+  for (; n + 16 <= len; n += 16) {
+    __m128i const v = _mm_loadu_si128((__m128i const *)(src + n));
+    __m128i const hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(v, 4), low4));
+    __m128i const lo = _mm_shuffle_epi8(digits, _mm_and_si128(v, low4));
+    _mm_storeu_si128((__m128i *)(dst + 2*n), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(dst + 2*n + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+  hex_scalar(dst + 2*n, src + n, len - n);
+}
+
+__attribute__((target("avx2")))
+static void hex_avx2(char *dst, unsigned char const *src, size_t len)
+{
+  __m256i const digits = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *)"0123456789abcdef"));
+  __m256i const low4 = _mm256_set1_epi8(0x0f);
+  size_t n = 0;
+  for (; n + 32 <= len; n += 32) {
+    __m256i const v = _mm256_loadu_si256((__m256i const *)(src + n));
+    __m256i const hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(v, 4), low4));
+    __m256i const lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(v, low4));
+    // Unpacking works within 128 bits lanes, so bytes 0-7 and 16-23 end up in a:
+    __m256i const a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i const b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256((__m256i *)(dst + 2*n), _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + 2*n + 32), _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  hex_sse42(dst + 2*n, src + n, len - n);
+}
+
+/* UTF-8 validation after Keiser and Lemire, "Validating UTF-8 In Less Than
+ * One Instruction Per Byte": each byte and its predecessor are classified
+ * by three nibble lookups whose AND is non zero for any error in a 2 bytes
+ * sequence; 3rd and 4th bytes of longer sequences are checked against the
+ * lead bytes 2 and 3 positions before. */
+#define U8_TOO_SHORT  (1<<0)  // lead byte not followed by a continuation
+#define U8_TOO_LONG   (1<<1)  // ASCII followed by a continuation
+#define U8_OVERLONG_3 (1<<2)
+#define U8_TOO_LARGE  (1<<3)
+#define U8_SURROGATE  (1<<4)
+#define U8_OVERLONG_2 (1<<5)
+#define U8_TOO_LARGE_1000 (1<<6)
+#define U8_OVERLONG_4 (1<<6)
+#define U8_TWO_CONTS  (1<<7)  // may be fine, if 3rd or 4th byte
+#define U8_CARRY (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+// Indexed by the high nibble of the previous byte:
+static char const utf8_byte_1_high[16] = {
+  U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+  U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+  U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+  U8_TOO_SHORT | U8_OVERLONG_2,
+  U8_TOO_SHORT,
+  U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+  U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+};
+
+// Indexed by the low nibble of the previous byte:
+static char const utf8_byte_1_low[16] = {
+  U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+  U8_CARRY | U8_OVERLONG_2,
+  U8_CARRY,
+  U8_CARRY,
+  U8_CARRY | U8_TOO_LARGE,
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+};
+
+// Indexed by the high nibble of the current byte:
+static char const utf8_byte_2_high[16] = {
+  U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+  U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+  U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+  U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE,
+  U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+  U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+  U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
 };
 
-static void ctx_ctor(struct ctx *ctx, int fd)
+// Last bytes of a block above which a sequence is not complete:
+static unsigned char const utf8_max_last[32] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xef, 0xdf, 0xbf,
+};
+
+__attribute__((target("sse4.2")))
+static bool utf8_check_sse42(unsigned char const *p, size_t len)
+{
+  __m128i const byte_1_high = _mm_loadu_si128((__m128i const *)utf8_byte_1_high);
+  __m128i const byte_1_low = _mm_loadu_si128((__m128i const *)utf8_byte_1_low);
+  __m128i const byte_2_high = _mm_loadu_si128((__m128i const *)utf8_byte_2_high);
+  __m128i const max_last = _mm_loadu_si128((__m128i const *)(utf8_max_last + 16));
+  __m128i const low4 = _mm_set1_epi8(0x0f);
+  __m128i prev = _mm_setzero_si128(), incomplete = prev, error = prev;
+  size_t n = 0;
+  for (; n + 16 <= len; n += 16) {
+    __m128i const v = _mm_loadu_si128((__m128i const *)(p + n));
+    if (0 == _mm_movemask_epi8(v)) {
+      error = _mm_or_si128(error, incomplete);
+    } else {
+      __m128i const prev1 = _mm_alignr_epi8(v, prev, 15);
+      __m128i const sc = _mm_and_si128(_mm_and_si128(
+        _mm_shuffle_epi8(byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), low4)),
+        _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, low4))),
+        _mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(v, 4), low4)));
+      __m128i const third = _mm_subs_epu8(_mm_alignr_epi8(v, prev, 14), _mm_set1_epi8(0xe0 - 0x80));
+      __m128i const fourth = _mm_subs_epu8(_mm_alignr_epi8(v, prev, 13), _mm_set1_epi8(0xf0 - 0x80));
+      __m128i const must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(0x80));
+      error = _mm_or_si128(error, _mm_xor_si128(must23, sc));
+      incomplete = _mm_subs_epu8(v, max_last);
+    }
+    prev = v;
+  }
+  if (! _mm_testz_si128(error, error)) return false;
+  n = utf8_restart(p, n);
+  return utf8_check_scalar(p + n, len - n);
+}
+
+// Previous bytes, across the 128 bits lanes:
+#define PREV_AVX2(v, prev, nb) \
+  _mm256_alignr_epi8(v, _mm256_permute2x128_si256(prev, v, 0x21), 16 - (nb))
+
+__attribute__((target("avx2")))
+static bool utf8_check_avx2(unsigned char const *p, size_t len)
+{
+  __m256i const byte_1_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *)utf8_byte_1_high));
+  __m256i const byte_1_low = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *)utf8_byte_1_low));
+  __m256i const byte_2_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *)utf8_byte_2_high));
+  __m256i const max_last = _mm256_loadu_si256((__m256i const *)utf8_max_last);
+  __m256i const low4 = _mm256_set1_epi8(0x0f);
+  __m256i prev = _mm256_setzero_si256(), incomplete = prev, error = prev;
+  size_t n = 0;
+  for (; n + 32 <= len; n += 32) {
+    __m256i const v = _mm256_loadu_si256((__m256i const *)(p + n));
+    if (0 == _mm256_movemask_epi8(v)) {
+      error = _mm256_or_si256(error, incomplete);
+    } else {
+      __m256i const prev1 = PREV_AVX2(v, prev, 1);
+      __m256i const sc = _mm256_and_si256(_mm256_and_si256(
+        _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low4)),
+        _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, low4))),
+        _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(v, 4), low4)));
+      __m256i const third = _mm256_subs_epu8(PREV_AVX2(v, prev, 2), _mm256_set1_epi8(0xe0 - 0x80));
+      __m256i const fourth = _mm256_subs_epu8(PREV_AVX2(v, prev, 3), _mm256_set1_epi8(0xf0 - 0x80));
+      __m256i const must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(0x80));
+      error = _mm256_or_si256(error, _mm256_xor_si256(must23, sc));
+      incomplete = _mm256_subs_epu8(v, max_last);
+    }
+    prev = v;
+  }
+  if (! _mm256_testz_si256(error, error)) return false;
+  n = utf8_restart(p, n);
+  return utf8_check_sse42(p + n, len - n);
+}
+#undef PREV_AVX2
+
+// The compiler vectorizes these with vpshufb:
+__attribute__((target("avx2")))
+static void bswap_run_avx2(uint64_t *vals, size_t nb, size_t width)
+{
+  bswap_run_body(vals, nb, width);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void bswap_run_avx512(uint64_t *vals, size_t nb, size_t width)
+{
+  bswap_run_body(vals, nb, width);
+}
+#endif
+
+static void simd_bind(enum simd_level level)
+{
+  simd_level = level;
+  hex_kernel = hex_scalar;
+  json_scan = json_scan_scalar;
+  bswap_run = bswap_run_scalar;
+  utf8_check = utf8_check_scalar;
+# if defined(__x86_64__) || defined(__i386__)
+  switch (level) {
+    case SIMD_AVX512:
+      json_scan = json_scan_avx512;
+      hex_kernel = hex_avx2;  // no gain from wider registers for the short bins we see
+      bswap_run = bswap_run_avx512;
+      utf8_check = utf8_check_avx2;
+      break;
+    case SIMD_AVX2:
+      json_scan = json_scan_avx2;
+      hex_kernel = hex_avx2;
+      bswap_run = bswap_run_avx2;
+      utf8_check = utf8_check_avx2;
+      break;
+    case SIMD_SSE42:
+      json_scan = json_scan_sse42;
+      hex_kernel = hex_sse42;
+      utf8_check = utf8_check_sse42;
+      break;
+    default:
+      break;
+  }
+# endif
+}
+
+static void simd_ctor(void)
+{
+  simd_best = SIMD_SCALAR;
+# if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) simd_best = SIMD_SSE42;
+  if (simd_best == SIMD_SSE42 && __builtin_cpu_supports("avx2")) simd_best = SIMD_AVX2;
+  if (simd_best == SIMD_AVX2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    simd_best = SIMD_AVX512;
+# endif
+
+  enum simd_level level = simd_best;
+  char const *forced = getenv("MSGPACK_DUMP_SIMD");
+  if (forced && forced[0] != '\0') {
+    unsigned l;
+    for (l = 0; l < SIMD_NB_LEVELS && 0 != strcmp(forced, simd_names[l]); l++) ;
+    if (l == SIMD_NB_LEVELS) {
+      fprintf(stderr, "Unknown MSGPACK_DUMP_SIMD level '%s', using %s\n", forced, simd_names[level]);
+    } else if (l > simd_best) {
+      fprintf(stderr, "This CPU does not support %s, using %s\n", forced, simd_names[level]);
+    } else {
+      level = l;
+    }
+  }
+  simd_bind(level);
+}
+
+/*
+ * Output
+ *
+ * Everything goes through this buffer so that formatters can write
+ * directly into it.
+ */
+
+#define OBUF_SIZE (64 * 1024)
+static char obuf[OBUF_SIZE];
+static size_t olen;
+// So that output being built in obuf can tell it's still all there:
+static uint64_t out_nb_flushes;
+
+static void out_flush(void)
+{
+  size_t done = 0;
+  while (done < olen) {
+    ssize_t ret = do_write(1, obuf + done, olen - done);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0) {
+      fprintf(stderr, "Cannot write %zu bytes: %s\n", olen - done, strerror(errno));
+      exit(1);
+    }
+    done += ret;
+  }
+  olen = 0;
+  out_nb_flushes ++;
+}
+
+// Return where to write the next sz bytes (at most OBUF_SIZE).
+// Caller must then advance olen by how much it actually wrote.
+static char *out_reserve(size_t sz)
+{
+  assert(sz <= OBUF_SIZE);
+  if (OBUF_SIZE - olen < sz) out_flush();
+  return obuf + olen;
+}
+
+static void out_mem(void const *buf_, size_t sz)
+{
+  char const *buf = buf_;
+  while (sz > 0) {
+    if (olen == OBUF_SIZE) out_flush();
+    size_t n = OBUF_SIZE - olen;
+    if (n > sz) n = sz;
+    memcpy(obuf + olen, buf, n);
+    olen += n;
+    buf += n;
+    sz -= n;
+  }
+}
+
+static void out_char(char c)
+{
+  if (olen == OBUF_SIZE) out_flush();
+  obuf[olen++] = c;
+}
+
+static void out_printf(char const *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  char *p = out_reserve(128);
+  int len = vsnprintf(p, OBUF_SIZE - olen, fmt, ap);
+  va_end(ap);
+  assert(len >= 0 && (size_t)len < OBUF_SIZE - olen);
+  olen += len;
+}
+
+/*
+ * Integer formatting
+ *
+ * Digits are produced two at a time from the end, once the number of digits
+ * is known (from the number of significant bits).
+ */
+
+static char const digit_pairs[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+static unsigned nb_digits(uint64_t n)
+{
+  static uint64_t const pow10[20] = {
+    0, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+    1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+    1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL };
+  // 1233/4096 ~= log10(2):
+  unsigned t = ((64 - __builtin_clzll(n | 1)) * 1233) >> 12;
+  return t + 1 - (n < pow10[t]);
+}
+
+// Largest possible output of fmt_u64 or fmt_i64:
+#define MAX_INT_LEN 20
+
+// Write n in decimal at buf and return the length.
+static size_t fmt_u64(char *buf, uint64_t n)
+{
+  size_t const len = nb_digits(n);
+  char *p = buf + len;
+  while (n >= 100) {
+    unsigned i = (n % 100) * 2;
+    n /= 100;
+    *--p = digit_pairs[i + 1];
+    *--p = digit_pairs[i];
+  }
+  if (n >= 10) {
+    *--p = digit_pairs[n * 2 + 1];
+    *--p = digit_pairs[n * 2];
+  } else {
+    *--p = '0' + n;
+  }
+  return len;
+}
+
+static size_t fmt_i64(char *buf, int64_t n)
+{
+  if (n >= 0) return fmt_u64(buf, n);
+  buf[0] = '-';
+  return 1 + fmt_u64(buf + 1, -(uint64_t)n);
+}
+
+static void out_u64(uint64_t n)
+{
+  olen += fmt_u64(out_reserve(MAX_INT_LEN), n);
+}
+
+static void out_i64(int64_t n)
+{
+  olen += fmt_i64(out_reserve(MAX_INT_LEN), n);
+}
+
+// Decimal representation of every fixint, indexed by tag:
+static struct fixint_str {
+  unsigned char len;
+  char str[4];
+} fixint_strs[256];
+
+static void fixint_strs_ctor(void)
+{
+  for (unsigned fst = 0; fst < 256; fst++) {
+    if ((fst & 0x80) == 0) {
+      fixint_strs[fst].len = fmt_i64(fixint_strs[fst].str, fst);
+    } else if ((fst & 0xe0) == 0xe0) {
+      fixint_strs[fst].len = fmt_i64(fixint_strs[fst].str, (int8_t)fst);
+    }
+  }
+}
+
+static void out_fixint(unsigned char fst)
+{
+  struct fixint_str const *f = fixint_strs + fst;
+  memcpy(out_reserve(sizeof(f->str)), f->str, sizeof(f->str));
+  olen += f->len;
+}
+
+
+/*
+ * Timestamps
+ *
+ * The timestamp extension (type -1) is printed as an ISO-8601 date, in UTC
+ * and with nanoseconds. Streams tend to have a timestamp per record, all
+ * on the same day, so the date of the last one is kept.
+ */
+
+#define EXT_TIMESTAMP -1
+
+// Largest output of fmt_timestamp (years of 64 bits seconds have 12 digits):
+#define MAX_TIMESTAMP_LEN 40
+
+static struct {
+  int64_t day;  // Since the epoch
+  size_t len;
+  char str[24];  // "YYYY-MM-DDT"
+} ts_day = { .day = INT64_MIN };
+
+// Date of a number of days since the epoch, with Hinnant's algorithm (the
+// reverse of days_from_civil), working with 400 years eras from March 1st:
+static void civil_from_days(int64_t z, int64_t *y, unsigned *m, unsigned *d)
+{
+  z += 719468;
+  int64_t const era = (z >= 0 ? z : z - 146096) / 146097;
+  unsigned const doe = z - era * 146097;
+  unsigned const yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  unsigned const doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  unsigned const mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp < 10 ? mp + 3 : mp - 9;
+  *y = (int64_t)yoe + era * 400 + (*m <= 2);
+}
+
+static char *fmt_2digits(char *p, unsigned n)
+{
+  memcpy(p, digit_pairs + n * 2, 2);
+  return p + 2;
+}
+
+// Write the timestamp in data at buf and return the length, or 0 if it's
+// not a valid timestamp.
+static size_t fmt_timestamp(char *buf, unsigned char const *data, size_t len)
+{
+  uint32_t v32;
+  uint64_t v64;
+  int64_t sec;
+  uint32_t nsec;
+  switch (len) {
+    case 4:
+      memcpy(&v32, data, 4);
+      sec = __builtin_bswap32(v32);
+      nsec = 0;
+      break;
+    case 8:
+      memcpy(&v64, data, 8);
+      v64 = __builtin_bswap64(v64);
+      sec = v64 & ((1ULL << 34) - 1);
+      nsec = v64 >> 34;
+      break;
+    case 12:
+      memcpy(&v32, data, 4);
+      memcpy(&v64, data + 4, 8);
+      nsec = __builtin_bswap32(v32);
+      sec = (int64_t)__builtin_bswap64(v64);
+      break;
+    default:
+      return 0;
+  }
+  if (nsec > 999999999) return 0;
+
+  int64_t day = sec / 86400;
+  int64_t sod = sec % 86400;
+  if (sod < 0) {
+    sod += 86400;
+    day --;
+  }
+  if (day != ts_day.day) {
+    int64_t y;
+    unsigned m, d;
+    civil_from_days(day, &y, &m, &d);
+    ts_day.len = snprintf(ts_day.str, sizeof(ts_day.str), "%04"PRId64"-%02u-%02uT", y, m, d);
+    ts_day.day = day;
+  }
+
+  memcpy(buf, ts_day.str, ts_day.len);
+  char *p = buf + ts_day.len;
+  p = fmt_2digits(p, sod / 3600);
+  *p++ = ':';
+  p = fmt_2digits(p, sod / 60 % 60);
+  *p++ = ':';
+  p = fmt_2digits(p, sod % 60);
+  *p++ = '.';
+  for (int i = 8; i >= 0; i--) {
+    p[i] = '0' + nsec % 10;
+    nsec /= 10;
+  }
+  p += 9;
+  *p++ = 'Z';
+  return p - buf;
+}
+
+/*
+ * Extension types
+ *
+ * Decoders registered for an ext type write its text in ext_text, which
+ * the mode then prints as it prints strings. Some are compiled in, others
+ * are loaded from the plugins directory (see msgpack-dump-ext.h).
+ * Payloads of other types, or that their decoder rejects, are hex dumped.
+ */
+
+static struct ext_decoder {
+  char const *name;
+  msgpack_dump_ext_decoder *decode;
+} ext_decoders[256];  // Indexed by the type, as an unsigned byte
+
+static struct {
+  char *buf;
+  size_t len, size;
+} ext_text;
+
+// Make room for sz more bytes of text:
+static void ext_reserve(size_t sz)
+{
+  if (ext_text.len + sz <= ext_text.size) return;
+  size_t size = ext_text.size ? ext_text.size : 256;
+  while (size < ext_text.len + sz) size *= 2;
+  char *buf = realloc(ext_text.buf, size);
+  if (! buf) {
+    fprintf(stderr, "Cannot alloc %zu bytes for an ext type\n", size);
+    exit(1);
+  }
+  ext_text.buf = buf;
+  ext_text.size = size;
+}
+
+static void ext_write(char const *data, size_t len)
+{
+  ext_reserve(len);
+  memcpy(ext_text.buf + ext_text.len, data, len);
+  ext_text.len += len;
+}
+
+static void ext_printf(char const *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  if (len < 0) return;
+  ext_reserve(len + 1);
+  va_start(ap, fmt);
+  vsnprintf(ext_text.buf + ext_text.len, len + 1, fmt, ap);
+  va_end(ap);
+  ext_text.len += len;
+}
+
+static void ext_add_decoder(int type, char const *name, msgpack_dump_ext_decoder *decode)
+{
+  if (type < -128 || type > 127) {
+    fprintf(stderr, "Cannot register decoder %s for ext type %d\n", name, type);
+    return;
+  }
+  ext_decoders[(unsigned char)type] = (struct ext_decoder){ .name = name, .decode = decode };
+}
+
+static struct msgpack_dump_ext_host const ext_host = {
+  .version = MSGPACK_DUMP_EXT_VERSION,
+  .write = ext_write,
+  .printf = ext_printf,
+  .add_decoder = ext_add_decoder,
+};
+
+// Fill ext_text with the text of that payload, or return false:
+static bool ext_decode(unsigned char type, char const *data, size_t len)
+{
+  struct ext_decoder const *d = ext_decoders + type;
+  if (! d->decode) return false;
+  ext_text.len = 0;
+  return d->decode((int8_t)type, (unsigned char const *)data, len);
+}
+
+static bool ext_timestamp(int type, unsigned char const *data, size_t len)
+{
+  (void)type;
+  char buf[MAX_TIMESTAMP_LEN];
+  size_t const l = fmt_timestamp(buf, data, len);
+  if (l == 0) return false;
+  ext_write(buf, l);
+  return true;
+}
+
+static int is_plugin(struct dirent const *e)
+{
+  size_t const len = strlen(e->d_name);
+  return len > 3 && 0 == strcmp(e->d_name + len - 3, ".so");
+}
+
+// Load every *.so in dir, in name order:
+static bool ext_plugins_load(char const *dir)
+{
+  struct dirent **entries;
+  int nb = scandir(dir, &entries, is_plugin, alphasort);
+  if (nb < 0) {
+    fprintf(stderr, "Cannot list plugins directory '%s': %s\n", dir, strerror(errno));
+    return false;
+  }
+  bool ok = true;
+  for (int i = 0; i < nb; i++) {
+    char fname[PATH_MAX];
+    snprintf(fname, sizeof(fname), "%s/%s", dir, entries[i]->d_name);
+    free(entries[i]);
+    if (! ok) continue;
+    void *lib = dlopen(fname, RTLD_NOW | RTLD_LOCAL);
+    if (! lib) {
+      fprintf(stderr, "Cannot load plugin: %s\n", dlerror());
+      ok = false;
+      continue;
+    }
+    bool (*init)(struct msgpack_dump_ext_host const *);
+    *(void **)&init = dlsym(lib, "msgpack_dump_ext_init");
+    if (! init) {
+      fprintf(stderr, "Plugin %s has no msgpack_dump_ext_init\n", fname);
+      ok = false;
+    } else if (! init(&ext_host)) {
+      fprintf(stderr, "Plugin %s failed to initialize\n", fname);
+      ok = false;
+    }
+  }
+  free(entries);
+  return ok;
+}
+
+static void ext_ctor(void)
+{
+  ext_add_decoder(EXT_TIMESTAMP, "timestamp", ext_timestamp);
+}
+
+
+// Error checked IO
+
+// Read some more into the input buffer, after what's already there.
+// Returns the number of bytes added, 0 at end of file or -1 on error.
+static ssize_t fill(struct ctx *ctx)
+{
+  if (ctx->fd < 0) return 0;
+  if (ctx->ipos > 0) {
+    memmove(ctx->ibuf, ctx->ibuf + ctx->ipos, ctx->ilen - ctx->ipos);
+    ctx->ilen -= ctx->ipos;
+    ctx->ipos = 0;
+  }
+  while (true) {
+    ssize_t ret = do_read(ctx->fd, ctx->ibuf + ctx->ilen, IBUF_SIZE - ctx->ilen);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0) {
+      fprintf(stderr, "Cannot read: %s\n", strerror(errno));
+    } else {
+      ctx->ilen += ret;
+    }
+    return ret;
+  }
+}
+
+static bool eread(struct ctx *ctx, void *buf_, size_t sz)
+{
+  unsigned char *buf = buf_;
+  if (ctx->eof) return false;
+  PROF_COUNT(PROF_EREAD, sz);
+
+  while (sz > 0) {
+    size_t avail = ctx->ilen - ctx->ipos;
+    if (avail == 0) {
+      ssize_t ret;
+      if (sz >= IBUF_SIZE && ctx->fd >= 0) {
+        // Do not bother copying big chunks through the buffer:
+        ret = do_read(ctx->fd, buf, sz);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) fprintf(stderr, "Cannot read %zu bytes: %s\n", sz, strerror(errno));
+        if (ret > 0) {
+          buf += ret;
+          sz -= ret;
+          ctx->offset += ret;
+        }
+      } else {
+        ret = fill(ctx);
+      }
+      if (ret == 0) ctx->eof = true;
+      if (ret <= 0) return false;
+      continue;
+    }
+    size_t n = avail < sz ? avail : sz;
+    memcpy(buf, ctx->ibuf + ctx->ipos, n);
+    buf += n;
+    sz -= n;
+    ctx->ipos += n;
+    ctx->offset += n;
+  }
+  return true;
+}
+
+// Return a pointer to the next sz bytes without consuming them, or NULL if
+// that many bytes cannot be buffered.
+static unsigned char const *epeek(struct ctx *ctx, size_t sz)
+{
+  while (ctx->ilen - ctx->ipos < sz) {
+    if (sz > IBUF_SIZE || fill(ctx) <= 0) return NULL;
+  }
+  return ctx->ibuf + ctx->ipos;
+}
+
+// Consume sz bytes that have been peeked already.
+static void eskip(struct ctx *ctx, size_t sz)
+{
+  assert(ctx->ilen - ctx->ipos >= sz);
+  ctx->ipos += sz;
+  ctx->offset += sz;
+}
+
+/*
+ * Arena
+ *
+ * Transient memory needed while decoding a top level value is bump
+ * allocated from blocks that are reset, but kept, once that value is
+ * done. Blocks allocated for exceptionally big payloads are given back
+ * at reset though.
+ */
+
+#define ARENA_BLOCK (64 * 1024)
+#define ARENA_HUGE_BLOCK (2 * 1024 * 1024)
+#define ARENA_MAX_KEEP (16 * 1024 * 1024)
+
+struct arena_block {
+  struct arena_block *next;
+  size_t size;  // Including this header
+  size_t used;
+  unsigned char data[];
+};
+
+static struct arena {
+  struct arena_block *first;
+  struct arena_block *cur;
+  bool huge_pages;  // Back blocks with transparent huge pages
+} arena;
+
+static struct arena_block *arena_block_new(struct arena *a, size_t sz)
+{
+  size_t const unit = a->huge_pages ? ARENA_HUGE_BLOCK : ARENA_BLOCK;
+  size_t size = sizeof(struct arena_block) + sz;
+  size = (size + unit - 1) / unit * unit;
+  struct arena_block *b = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (b == MAP_FAILED) {
+    fprintf(stderr, "Cannot alloc %zu bytes: %s\n", size, strerror(errno));
+    return NULL;
+  }
+# ifdef MADV_HUGEPAGE
+  if (a->huge_pages) (void)madvise(b, size, MADV_HUGEPAGE);
+# endif
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+static void *arena_alloc(struct arena *a, size_t sz)
+{
+  sz = (sz + 15) & ~(size_t)15;
+  struct arena_block **bp = a->cur ? &a->cur : &a->first;
+  while (*bp) {
+    struct arena_block *b = *bp;
+    if (b->size - sizeof(*b) - b->used >= sz) {
+      void *ptr = b->data + b->used;
+      b->used += sz;
+      a->cur = b;
+      return ptr;
+    }
+    bp = &b->next;
+  }
+  // No room left in any block: append a new one.
+  struct arena_block *b = arena_block_new(a, sz);
+  if (! b) return NULL;
+  *bp = b;
+  b->used = sz;
+  a->cur = b;
+  return b->data;
+}
+
+static void arena_reset(struct arena *a)
+{
+  struct arena_block **bp = &a->first;
+  while (*bp) {
+    struct arena_block *b = *bp;
+    if (b->size > ARENA_MAX_KEEP) {
+      *bp = b->next;
+      munmap(b, b->size);
+    } else {
+      b->used = 0;
+      bp = &b->next;
+    }
+  }
+  a->cur = NULL;
+}
+
+static void arena_dtor(struct arena *a)
+{
+  while (a->first) {
+    struct arena_block *b = a->first;
+    a->first = b->next;
+    munmap(b, b->size);
+  }
+  a->cur = NULL;
+}
+
+/*
+ * Decoding helpers shared by all output modes
+ */
+
+static bool read_varint(struct ctx *ctx, uint64_t *n, size_t lenlen, bool sign)
+{
+  *n = 0;
+  unsigned char byte;
+  for (unsigned cb = 0; cb < lenlen; cb++) {
+    *n <<= 8;  // big endian is not dead
+    if (! eread(ctx, &byte, 1)) return false;
+    *n |= byte;
+  }
+  if (sign && lenlen < 8 && (*n >> (lenlen * 8 - 1)) != 0) {
+    *n |= ~0ULL << (lenlen * 8);
+  }
+  return true;
+}
+static bool read_varuint(struct ctx *ctx, uint64_t *n, size_t lenlen)
+{
+  return read_varint(ctx, n, lenlen, false);
+}
+
+static double float_of_bits(uint64_t bits, size_t width)
+{
+  if (width == 4) {
+    uint32_t b32 = bits;
+    float v;
+    memcpy(&v, &b32, sizeof(v));
+    return v;
+  } else {
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+  }
+}
+
+// Consume sz bytes without looking at them.
+static bool ediscard(struct ctx *ctx, size_t sz)
+{
+  if (ctx->eof) return false;
+
+  while (sz > 0) {
+    size_t avail = ctx->ilen - ctx->ipos;
+    if (avail == 0) {
+      ssize_t ret = fill(ctx);
+      if (ret == 0) ctx->eof = true;
+      if (ret <= 0) return false;
+      continue;
+    }
+    size_t n = avail < sz ? avail : sz;
+    eskip(ctx, n);
+    sz -= n;
+  }
+  return true;
+}
+
+/*
+ * Arrays of numbers
+ *
+ * Arrays of numbers only are printed on a single line. Runs of elements
+ * sharing the same numeric tag are then decoded in batch straight from the
+ * input buffer.
+ */
+
+// Width of the value following a numeric tag, or -1 if that's not a number.
+static int num_width(unsigned char fst)
+{
+  if ((fst & 0x80) == 0 || (fst & 0xe0) == 0xe0) return 0;
+  switch (fst) {
+    case 0xcc: case 0xd0: return 1;
+    case 0xcd: case 0xd1: return 2;
+    case 0xce: case 0xd2: case 0xca: return 4;
+    case 0xcf: case 0xd3: case 0xcb: return 8;
+  }
+  return -1;
+}
+
+// Tell if the next array of nb_objs items holds only numbers, looking no
+// further than what fits in the input buffer. Beyond that it is assumed to,
+// and dump_num_array() falls back to one item per line at the first item
+// that is not a number.
+static bool nums_ahead(struct ctx *ctx, size_t nb_objs)
+{
+  size_t pos = 0;
+  for (size_t n = 0; n < nb_objs; n++) {
+    unsigned char const *p = epeek(ctx, pos + 1);
+    if (! p) return true;
+    int const width = num_width(p[pos]);
+    if (width < 0) return false;
+    pos += 1 + width;
+  }
+  return true;
+}
+
+// Fixints carry their value in the tag, so a run is made of tags of the same
+// class rather than of the very same tag.
+static bool same_num_tag(unsigned char t1, unsigned char t2)
+{
+  if ((t1 & 0x80) == 0) return (t2 & 0x80) == 0;
+  if ((t1 & 0xe0) == 0xe0) return (t2 & 0xe0) == 0xe0;
+  return t1 == t2;
+}
+
+#define RUN_MAX 256
+
+// Gather the big endian values of a run of up to max elements starting with
+// tag fst from the input buffer, and return how many were read.
+static size_t read_num_run(struct ctx *ctx, unsigned char fst, size_t width, size_t max, uint64_t *vals)
+{
+  size_t const stride = 1 + width;
+  unsigned char const *p = ctx->ibuf + ctx->ipos;
+  size_t avail = (ctx->ilen - ctx->ipos) / stride;
+  if (max > avail) max = avail;
+  if (max > RUN_MAX) max = RUN_MAX;
+
+  size_t nb = 0;
+  switch (width) {
+    case 0:
+      for (; nb < max && same_num_tag(fst, p[nb]); nb++) vals[nb] = p[nb];
+      break;
+    case 1:
+      for (; nb < max && p[nb*stride] == fst; nb++) vals[nb] = p[nb*stride + 1];
+      break;
+#   define GATHER(bits) \
+      for (; nb < max && p[nb*stride] == fst; nb++) { \
+        uint##bits##_t v; \
+        memcpy(&v, p + nb*stride + 1, sizeof(v)); \
+        vals[nb] = v; \
+      } \
+      /* Separate pass over contiguous values, so that it can be vectorized: */ \
+      bswap_run(vals, nb, bits / 8); \
+      break;
+    case 2: GATHER(16)
+    case 4: GATHER(32)
+    case 8: GATHER(64)
+#   undef GATHER
+  }
+  eskip(ctx, nb * stride);
+  return nb;
+}
+
+
+// Largest output of a float or any other number (floats are printed with %g):
+#define MAX_NUM_LEN 32
+
+// JSON has no representation for infinities and NaNs.
+static size_t fmt_double(char *buf, double v, bool json)
+{
+  if (json && ! isfinite(v)) {
+    memcpy(buf, "null", 4);
+    return 4;
+  }
+  return snprintf(buf, MAX_NUM_LEN, "%g", v);
+}
+
+// Format a run of values into buf, which must be big enough. n is the index
+// of the first value in the array, so that separators are added only
+// between values.
+static size_t format_num_run(char *buf, unsigned char fst, uint64_t const *vals, size_t nb, size_t n, char const *sep, bool json)
+{
+  size_t const sep_len = strlen(sep);
+  size_t len = 0;
+  for (size_t i = 0; i < nb; i++) {
+    if (n + i > 0) {
+      memcpy(buf + len, sep, sep_len);
+      len += sep_len;
+    }
+    switch (fst) {
+      case 0xca: len += fmt_double(buf + len, float_of_bits(vals[i], 4), json); break;
+      case 0xcb: len += fmt_double(buf + len, float_of_bits(vals[i], 8), json); break;
+      case 0xd0: len += fmt_i64(buf + len, (int8_t)vals[i]); break;
+      case 0xd1: len += fmt_i64(buf + len, (int16_t)vals[i]); break;
+      case 0xd2: len += fmt_i64(buf + len, (int32_t)vals[i]); break;
+      case 0xd3: len += fmt_i64(buf + len, (int64_t)vals[i]); break;
+      default:
+        if ((fst & 0x80) == 0 || (fst & 0xe0) == 0xe0) {
+          struct fixint_str const *f = fixint_strs + vals[i];
+          memcpy(buf + len, f->str, sizeof(f->str));
+          len += f->len;
+        } else {
+          len += fmt_u64(buf + len, vals[i]);
+        }
+        break;
+    }
+  }
+  return len;
+}
+
+static void out_num_run(unsigned char fst, uint64_t const *vals, size_t nb, size_t n, char const *sep, bool json)
+{
+  char *buf = out_reserve(nb * (strlen(sep) + MAX_NUM_LEN));
+  olen += format_num_run(buf, fst, vals, nb, n, sep, json);
+}
+
+static void out_double(double v, bool json)
+{
+  olen += fmt_double(out_reserve(MAX_NUM_LEN), v, json);
+}
+
+static void out_hex(char const *data, size_t len, bool spaced)
+{
+  static char const hex[16] = "0123456789abcdef";
+  if (! spaced) {
+    while (len > 0) {
+      size_t const n = len < OBUF_SIZE / 2 ? len : OBUF_SIZE / 2;
+      hex_kernel(out_reserve(2 * n), (unsigned char const *)data, n);
+      olen += 2 * n;
+      data += n;
+      len -= n;
+    }
+    return;
+  }
+  for (size_t n = 0; n < len; n++) {
+    unsigned char c = data[n];
+    char *p = out_reserve(3);
+    if (n > 0) *p++ = ' ';
+    *p++ = hex[c >> 4];
+    *p++ = hex[c & 15];
+    olen = p - obuf;
+  }
+}
+
+// Output the chars of a JSON string, escaped but without quotes.
+static void out_json_chars(char const *data, size_t len)
+{
+  static char const hex[16] = "0123456789abcdef";
+  size_t done = 0;
+  while (true) {
+    size_t const n = done + json_scan((unsigned char const *)data + done, len - done);
+    out_mem(data + done, n - done);
+    if (n >= len) break;
+    unsigned char c = data[n];
+    done = n + 1;
+    char *p = out_reserve(6);
+    *p++ = '\\';
+    switch (c) {
+      case '"': *p++ = '"'; break;
+      case '\\': *p++ = '\\'; break;
+      case '\n': *p++ = 'n'; break;
+      case '\r': *p++ = 'r'; break;
+      case '\t': *p++ = 't'; break;
+      case '\b': *p++ = 'b'; break;
+      case '\f': *p++ = 'f'; break;
+      default:
+        memcpy(p, "u00", 3);
+        p += 3;
+        *p++ = hex[c >> 4];
+        *p++ = hex[c & 15];
+        break;
+    }
+    olen = p - obuf;
+  }
+}
+
+// Output a string with its double quotes doubled, as CSV wants.
+static void out_csv_str(char const *data, size_t len)
+{
+  size_t done = 0;
+  for (size_t n = 0; n < len; n++) {
+    if (data[n] != '"') continue;
+    out_mem(data + done, n + 1 - done);
+    done = n;
+  }
+  out_mem(data + done, len - done);
+}
+
+/*
+ * Strings are output only once checked to be valid UTF-8. What becomes of
+ * invalid bytes is chosen with --invalid-utf8: each is replaced by U+FFFD,
+ * or escaped as \xNN (with the backslash escaped in JSON so that the
+ * output stays valid), or the program stops.
+ */
+
+enum utf8_policy { UTF8_REPLACE, UTF8_ESCAPE, UTF8_FAIL };
+static enum utf8_policy utf8_policy = UTF8_REPLACE;
+
+static void out_chars(char const *data, size_t len)
+{
+  out_mem(data, len);
+}
+
+static void out_invalid_utf8(char const *data, size_t len, void (*out)(char const *, size_t), bool json)
+{
+  static char const hex[16] = "0123456789abcdef";
+  size_t done = 0, n = 0;
+  while (n < len) {
+    size_t const l = utf8_seq_len((unsigned char const *)data + n, len - n);
+    if (l > 0) {
+      n += l;
+      continue;
+    }
+    if (utf8_policy == UTF8_FAIL) {
+      out_flush();
+      fprintf(stderr, "Invalid UTF-8 at byte %zu of a %zu bytes string\n", n, len);
+      exit(1);
+    }
+    out(data + done, n - done);
+    unsigned char const c = data[n];
+    if (utf8_policy == UTF8_REPLACE) {
+      out_mem("\xef\xbf\xbd", 3);
+    } else {
+      char *p = out_reserve(5);
+      if (json) *p++ = '\\';
+      *p++ = '\\';
+      *p++ = 'x';
+      *p++ = hex[c >> 4];
+      *p++ = hex[c & 15];
+      olen = p - obuf;
+    }
+    done = ++n;
+  }
+  out(data + done, len - done);
+}
+
+// Output a string with out, once made valid UTF-8:
+static inline void out_utf8(char const *data, size_t len, void (*out)(char const *, size_t), bool json)
+{
+  if (utf8_check((unsigned char const *)data, len)) out(data, len);
+  else out_invalid_utf8(data, len, out, json);
+}
+
+// Output a JSON string, quotes included.
+static void out_json_str(char const *data, size_t len)
+{
+  out_char('"');
+  out_utf8(data, len, out_json_chars, true);
+  out_char('"');
+}
+
+/*
+ * Map keys cache
+ *
+ * Records tend to repeat the same keys over and over, so modes can keep
+ * short str keys in this direct mapped cache along with their formatted
+ * output (see dump-loop.h), which is then copied as is.
+ */
+
+#define KEY_CACHE_SIZE 256  // Must be a power of 2
+#define KEY_MAX_LEN 62
+// Longest possible formatted key (JSON escapes take 6 bytes per char):
+#define KEY_MAX_OUT_LEN (6 * KEY_MAX_LEN + 8)
+
+struct key_cache {
+  struct key_cache_entry {
+    unsigned char raw_len;  // 0 if unused
+    unsigned char out_len;
+    unsigned char raw[2 + KEY_MAX_LEN];  // msgpack encoded key
+    char out[96];
+  } entries[KEY_CACHE_SIZE];
+};
+
+// FNV-1a
+static inline uint32_t key_hash(unsigned char const *data, size_t len)
+{
+  uint32_t h = 2166136261U;
+  for (size_t i = 0; i < len; i++) h = (h ^ data[i]) * 16777619U;
+  return h;
+}
+
+/*
+ * Record shapes
+ *
+ * Streams are often made of flat maps with the same keys, in the same
+ * order, with values of the same types. The shape of such a top level
+ * record (its map header, then every raw key followed by the class of its
+ * value's tag) is learned the first time it is seen, along with the
+ * constant output that goes around the values. Later records of the same
+ * shape then only have their values formatted (see dump-loop.h).
+ */
+
+#define SHAPE_NB 8
+#define SHAPE_MAX_FIELDS 64
+#define SHAPE_MAX_SIG 2048
+
+struct shape {
+  uint32_t hash;
+  size_t sig_len;  // 0 if unused
+  unsigned nb_fields;
+  unsigned char sig[SHAPE_MAX_SIG];
+  // Constant output, and where each value goes in it:
+  char *text;
+  size_t value_at[SHAPE_MAX_FIELDS + 1];  // the last one is the text length
+};
+
+struct shapes {
+  struct shape s[SHAPE_NB];
+  struct shape *last;  // records often have the same shape as the previous one
+};
+
+// A record that has just been scanned:
+struct shape_scan {
+  size_t sig_len;
+  unsigned nb_fields;
+  size_t len;
+  unsigned char sig[SHAPE_MAX_SIG];
+  // Offsets of keys and values from the start of the record:
+  size_t keys[SHAPE_MAX_FIELDS];
+  size_t vals[SHAPE_MAX_FIELDS];
+};
+
+static uint64_t load_be(unsigned char const *p, size_t len)
+{
+  uint64_t n = 0;
+  for (size_t i = 0; i < len; i++) n = (n << 8) | p[i];
+  return n;
+}
+
+static uint64_t sign_extend(uint64_t n, size_t len)
+{
+  if (len < 8 && (n >> (len * 8 - 1)) != 0) n |= ~0ULL << (len * 8);
+  return n;
+}
+
+// Header size of a str, or 0 if fst is not a str:
+static size_t str_hdr_len(unsigned char fst)
+{
+  if ((fst & 0xe0) == 0xa0) return 1;
+  if (fst == 0xd9) return 2;
+  if (fst == 0xda) return 3;
+  if (fst == 0xdb) return 5;
+  return 0;
+}
+
+// Size of the scalar at p, given there are avail bytes from there. Returns
+// 0 if it's not a scalar we know how to print from memory, and more than
+// avail if it does not fit.
+static size_t scalar_size(unsigned char const *p, size_t avail)
+{
+  unsigned char const fst = p[0];
+  if ((fst & 0x80) == 0 || (fst & 0xe0) == 0xe0) return 1;
+  switch (fst) {
+    case 0xc0: case 0xc2: case 0xc3: return 1;
+    case 0xcc: case 0xd0: return 2;
+    case 0xcd: case 0xd1: return 3;
+    case 0xce: case 0xd2: case 0xca: return 5;
+    case 0xcf: case 0xd3: case 0xcb: return 9;
+  }
+  size_t hdr_len = str_hdr_len(fst);
+  if (! hdr_len && fst >= 0xc4 && fst <= 0xc6) hdr_len = 1 + (1 << (fst - 0xc4));
+  if (! hdr_len) return 0;
+  if (hdr_len == 1) return 1 + (fst & 0x1f);
+  if (hdr_len > avail) return hdr_len;
+  return hdr_len + load_be(p + 1, hdr_len - 1);
+}
+
+// Values of the same class print the same way; fixints and fixstrs just
+// carry their value or length in the tag:
+static unsigned char tag_class(unsigned char fst)
+{
+  if ((fst & 0x80) == 0) return 0x00;
+  if ((fst & 0xe0) == 0xe0) return 0xe0;
+  if ((fst & 0xe0) == 0xa0) return 0xa0;
+  return fst;
+}
+
+// Check that the next value is a flat map with str keys, entirely in the
+// input buffer, and compute its shape. Nothing is consumed.
+static bool shape_scan(struct ctx *ctx, struct shape_scan *sc)
+{
+  size_t avail = 1;
+retry:;
+  unsigned char const *p = epeek(ctx, avail);
+  if (! p) return false;
+  avail = ctx->ilen - ctx->ipos;
+
+  size_t pos;
+  uint64_t nb_fields;
+  if ((p[0] & 0xf0) == 0x80) {
+    nb_fields = p[0] & 0x0f;
+    pos = 1;
+  } else if (p[0] == 0xde) {
+    if (avail < 3) goto more;
+    nb_fields = load_be(p + 1, 2);
+    pos = 3;
+  } else {
+    return false;
+  }
+  if (nb_fields == 0 || nb_fields > SHAPE_MAX_FIELDS) return false;
+  memcpy(sc->sig, p, pos);
+  sc->sig_len = pos;
+  sc->nb_fields = nb_fields;
+
+  for (unsigned n = 0; n < nb_fields; n++) {
+    if (pos >= avail) goto more;
+    if (! str_hdr_len(p[pos])) return false;
+    size_t const key_len = scalar_size(p + pos, avail - pos);
+    if (sc->sig_len + key_len + 1 > SHAPE_MAX_SIG) return false;
+    if (pos + key_len >= avail) goto more;
+    size_t const val_len = scalar_size(p + pos + key_len, avail - pos - key_len);
+    if (! val_len) return false;
+    if (pos + key_len + val_len > avail) goto more;
+    memcpy(sc->sig + sc->sig_len, p + pos, key_len);
+    sc->sig_len += key_len;
+    sc->sig[sc->sig_len ++] = tag_class(p[pos + key_len]);
+    sc->keys[n] = pos;
+    sc->vals[n] = pos + key_len;
+    pos += key_len + val_len;
+  }
+
+  sc->len = pos;
+  return true;
+
+more:
+  // The record is not buffered entirely yet:
+  if (avail >= IBUF_SIZE) return false;
+  avail ++;
+  goto retry;
+}
+
+/*
+ * Nested msgpack
+ *
+ * With --decode-nested, bins (and ext types asked for) whose payload is
+ * exactly one msgpack value are decoded in place, from memory, instead of
+ * being hex dumped. Whether a payload is msgpack is guessed by a quiet
+ * trial parse that must consume it all.
+ */
+
+static bool nested_bin;
+static bool nested_ext[256];  // Indexed by the type, as an unsigned byte
+
+// Size of the value at p if it's well formed and fits in avail bytes,
+// otherwise 0.
+static size_t value_size(unsigned char const *p, size_t avail)
+{
+  size_t pos = 0;
+  uint64_t pending = 1;  // Values still to go past
+  while (pending > 0) {
+    pending --;
+    if (pos >= avail) return 0;
+    unsigned char const fst = p[pos++];
+    size_t lenlen = 0;  // Size of the length that follows the tag...
+    bool is_data = true;  // ...which is a number of bytes, or else of items
+    uint64_t data = 0, per_item = 1;
+    if ((fst & 0x80) == 0 || (fst & 0xe0) == 0xe0) continue;
+    if ((fst & 0xf0) == 0x80) {
+      pending += 2 * (fst & 0x0f);
+      continue;
+    }
+    if ((fst & 0xf0) == 0x90) {
+      pending += fst & 0x0f;
+      continue;
+    }
+    if ((fst & 0xe0) == 0xa0) {
+      data = fst & 0x1f;
+    } else switch (fst) {
+      case 0xc0: case 0xc2: case 0xc3: continue;
+      case 0xc4: case 0xd9: lenlen = 1; break;
+      case 0xc5: case 0xda: lenlen = 2; break;
+      case 0xc6: case 0xdb: lenlen = 4; break;
+      case 0xc7: lenlen = 1; data = 1; break;  // The type
+      case 0xc8: lenlen = 2; data = 1; break;
+      case 0xc9: lenlen = 4; data = 1; break;
+      case 0xca: data = 4; break;
+      case 0xcb: data = 8; break;
+      case 0xcc: case 0xd0: data = 1; break;
+      case 0xcd: case 0xd1: data = 2; break;
+      case 0xce: case 0xd2: data = 4; break;
+      case 0xcf: case 0xd3: data = 8; break;
+      case 0xd4: data = 2; break;
+      case 0xd5: data = 3; break;
+      case 0xd6: data = 5; break;
+      case 0xd7: data = 9; break;
+      case 0xd8: data = 17; break;
+      case 0xdc: lenlen = 2; is_data = false; break;
+      case 0xdd: lenlen = 4; is_data = false; break;
+      case 0xde: lenlen = 2; is_data = false; per_item = 2; break;
+      case 0xdf: lenlen = 4; is_data = false; per_item = 2; break;
+      default: return 0;
+    }
+    if (lenlen > 0) {
+      if (avail - pos < lenlen) return 0;
+      uint64_t const n = load_be(p + pos, lenlen);
+      pos += lenlen;
+      if (is_data) data += n;
+      else pending += n * per_item;
+    }
+    if (avail - pos < data) return 0;
+    pos += data;
+    // Every value takes at least a byte:
+    if (pending > avail - pos) return 0;
+  }
+  return pos;
+}
+
+// Parse the comma separated list of payloads to decode: "bin" or ext types.
+static bool nested_parse(char const *list)
+{
+  if (! list) {
+    nested_bin = true;
+    return true;
+  }
+  while (*list != '\0') {
+    size_t const len = strcspn(list, ",");
+    char *end;
+    long type;
+    if (len == 3 && 0 == strncmp(list, "bin", 3)) {
+      nested_bin = true;
+    } else if (
+      len > 0 && (type = strtol(list, &end, 10), end == list + len) &&
+      type >= -128 && type <= 127
+    ) {
+      nested_ext[(unsigned char)type] = true;
+    } else {
+      fprintf(stderr, "Cannot decode nested '%.*s', which is neither bin nor an ext type\n", (int)len, list);
+      return false;
+    }
+    list += len;
+    if (*list == ',') list ++;
+  }
+  return true;
+}
+
+/*
+ * Bin extraction
+ *
+ * With --extract-bin, bins at the given path are written each to its own
+ * file of the output directory, and the file name is printed instead.
+ * Only what is already buffered goes through user space: the rest is
+ * copied by the kernel from the input, with copy_file_range from a file
+ * or splice from a pipe, or else read and written.
+ *
+ * While decoding, extract.depth is the number of leading path segments
+ * matched by the path to the current value.
+ */
+
+static struct extract {
+  struct query const *path;  // NULL unless --extract-bin
+  unsigned nb_segs;
+  char const *dir;
+  unsigned depth;
+  uint64_t nb_files;
+  bool no_copy_file_range, no_splice;
+} extract = { .dir = "." };
+
+// Tell if item n of the container whose items are at ctx->indent, which
+// is about to be decoded, matches the next path segment; then increase
+// extract.depth. Defined with the queries.
+static bool extract_enter(struct ctx *ctx, uint64_t n, bool is_map);
+
+// Tell if the value being decoded is at the path:
+static inline bool extract_here(struct ctx const *ctx)
+{
+  return extract.depth == extract.nb_segs && ctx->indent == extract.nb_segs;
+}
+
+static bool write_all(int fd, char const *data, size_t len, char const *fname)
+{
+  while (len > 0) {
+    ssize_t ret = do_write(fd, data, len);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0) {
+      fprintf(stderr, "Cannot write %zu bytes into '%s': %s\n", len, fname, strerror(errno));
+      return false;
+    }
+    data += ret;
+    len -= ret;
+  }
+  return true;
+}
+
+// Errors telling that a zero-copy syscall cannot be used with these files:
+static bool cannot_zero_copy(int err)
+{
+  return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == EBADF;
+}
+
+// Copy len bytes from the input, past its buffer, into out.
+static bool extract_copy(struct ctx *ctx, int out, size_t len, char const *fname)
+{
+  while (len > 0) {
+    ssize_t ret;
+    // Whether the kernel did the copy, which the stats did not see:
+    bool copied = true;
+    if (! extract.no_copy_file_range) {
+      ret = copy_file_range(ctx->fd, NULL, out, NULL, len, 0);
+      if (ret < 0 && cannot_zero_copy(errno)) {
+        extract.no_copy_file_range = true;
+        continue;
+      }
+    } else if (! extract.no_splice) {
+      ret = splice(ctx->fd, NULL, out, NULL, len, SPLICE_F_MOVE);
+      if (ret < 0 && cannot_zero_copy(errno)) {
+        extract.no_splice = true;
+        continue;
+      }
+    } else {
+      // The input buffer is empty by now:
+      ret = do_read(ctx->fd, ctx->ibuf, len < IBUF_SIZE ? len : IBUF_SIZE);
+      if (ret > 0 && ! write_all(out, (char const *)ctx->ibuf, ret, fname)) return false;
+      copied = false;  // counted by do_read and do_write
+    }
+    if (ret > 0 && copied) {
+      stats.bytes_in += ret;
+      stats.bytes_out += ret;
+    }
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0) {
+      fprintf(stderr, "Cannot copy %zu bytes into '%s': %s\n", len, fname, strerror(errno));
+      return false;
+    }
+    if (ret == 0) {
+      ctx->eof = true;
+      return false;
+    }
+    len -= ret;
+    ctx->offset += ret;
+  }
+  return true;
+}
+
+// Consume the len bytes of a bin payload into a new file, whose name is
+// written in fname.
+static bool extract_bin(struct ctx *ctx, size_t len, char *fname, size_t *fname_len)
+{
+  if (ctx->eof) return false;
+  int n = snprintf(fname, PATH_MAX, "%s/%"PRIu64".bin", extract.dir, extract.nb_files++);
+  if (n < 0 || n >= PATH_MAX) {
+    fprintf(stderr, "Output directory name is too long\n");
+    return false;
+  }
+  *fname_len = n;
+  int out = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (out < 0) {
+    fprintf(stderr, "Cannot create '%s': %s\n", fname, strerror(errno));
+    return false;
+  }
+
+  size_t buffered = ctx->ilen - ctx->ipos;
+  if (buffered > len) buffered = len;
+  bool ok = write_all(out, (char const *)ctx->ibuf + ctx->ipos, buffered, fname);
+  eskip(ctx, buffered);
+  len -= buffered;
+  if (ok && len > 0) {
+    if (ctx->fd < 0) {
+      ctx->eof = true;
+      ok = false;
+    } else {
+      ctx->ipos = ctx->ilen = 0;
+      ok = extract_copy(ctx, out, len, fname);
+    }
+  }
+  if (close(out) != 0 && ok) {
+    fprintf(stderr, "Cannot write '%s': %s\n", fname, strerror(errno));
+    ok = false;
+  }
+  return ok;
+}
+
+/*
+ * Output modes
+ *
+ * Each mode is a set of MODE_emit_* functions (and a MODE_skip_data flag
+ * telling whether str, bin and ext payloads are needed at all) with which
+ * dump-loop.h is instantiated below. Modes that share an emitter with
+ * another one just alias it.
+ *
+ * Emitters are called with ctx->indent set to the depth of the value.
+ */
+
+static void dump_indent(struct ctx *ctx)
+{
+# define TAB 3
+  size_t n = ctx->indent*TAB;
+# undef TAB
+  while (n > 0) {
+    size_t c = n < OBUF_SIZE ? n : OBUF_SIZE;
+    memset(out_reserve(c), ' ', c);
+    olen += c;
+    n -= c;
+  }
+}
+
+/* Text: the human readable, indented default */
+
+static bool const text_skip_data = false;
+
+static inline void text_emit_start(struct ctx *ctx, int role)
+{
+  if (role != ROLE_MAP_VALUE && role != ROLE_INLINE) {
+    dump_indent(ctx);
+  }
+  if (role >= 0) {
+    out_char('[');
+    out_u64(role);
+    out_mem("]: ", 3);
+  }
+}
+
+static struct key_cache text_key_cache;
+
+static inline void text_emit_key_prefix(struct ctx *ctx)
+{
+  dump_indent(ctx);
+}
+
+static inline void text_emit_stop(struct ctx *ctx, int role)
+{
+  (void)ctx;
+  if (role == ROLE_MAP_KEY) {
+    out_mem(": ", 2);
+  } else if (role != ROLE_INLINE) {
+    out_char('\n');
+  }
+}
+
+static inline void text_emit_nil(struct ctx *ctx)
+{
+  (void)ctx;
+  out_mem("()", 2);
+}
+
+static inline void text_emit_bool(struct ctx *ctx, bool b)
+{
+  (void)ctx;
+  if (b) out_mem("true", 4);
+  else out_mem("false", 5);
+}
+
+static inline void text_emit_fixint(struct ctx *ctx, unsigned char fst)
+{
+  (void)ctx;
+  out_fixint(fst);
+}
+
+static inline void text_emit_int(struct ctx *ctx, int64_t n)
+{
+  (void)ctx;
+  out_i64(n);
+}
+
+static inline void text_emit_uint(struct ctx *ctx, uint64_t n)
+{
+  (void)ctx;
+  out_u64(n);
+}
+
+static inline void text_emit_float(struct ctx *ctx, double v)
+{
+  (void)ctx;
+  out_double(v, false);
+}
+
+static inline void text_emit_str(struct ctx *ctx, char const *data, size_t len)
+{
+  (void)ctx;
+  out_char('"');
+  out_utf8(data, len, out_chars, false);
+  out_char('"');
+}
+
+static inline void text_emit_bin(struct ctx *ctx, char const *data, size_t len)
+{
+  (void)ctx;
+  out_hex(data, len, true);
+}
+
+static inline void text_emit_ext(struct ctx *ctx, unsigned char type, char const *data, size_t len)
+{
+  (void)ctx;
+  if (ext_decode(type, data, len)) {
+    out_utf8(ext_text.buf, ext_text.len, out_chars, false);
+    return;
+  }
+  out_printf("Type%d:", (int8_t)type);
+  out_hex(data, len, true);
+}
+
+static inline void text_emit_array_open(struct ctx *ctx, size_t nb_objs)
+{
+  (void)ctx; (void)nb_objs;
+  out_mem("[\n", 2);
+}
+
+static inline void text_emit_array_close(struct ctx *ctx, size_t nb_objs)
+{
+  (void)nb_objs;
+  dump_indent(ctx);
+  out_char(']');
+}
+
+static inline void text_emit_map_open(struct ctx *ctx, size_t nb_objs)
+{
+  (void)ctx; (void)nb_objs;
+  out_mem("{\n", 2);
+}
+
+static inline void text_emit_map_item(struct ctx *ctx, size_t n)
+{
+  (void)ctx; (void)n;
+}
+
+static inline void text_emit_map_close(struct ctx *ctx, size_t nb_objs)
+{
+  (void)nb_objs;
+  dump_indent(ctx);
+  out_char('}');
+}
+
+static inline void text_emit_num_array_open(struct ctx *ctx, size_t nb_objs)
+{
+  (void)ctx; (void)nb_objs;
+  out_char('[');
+}
+
+static inline void text_emit_num_run(struct ctx *ctx, unsigned char fst, uint64_t const *vals, size_t nb, size_t n)
+{
+  (void)ctx;
+  out_num_run(fst, vals, nb, n, ", ", false);
+}
+
+static inline void text_emit_inline_sep(struct ctx *ctx)
+{
+  (void)ctx;
+  out_mem(", ", 2);
+}
+
+static inline void text_emit_num_array_close(struct ctx *ctx, size_t nb_objs)
+{
+  (void)ctx; (void)nb_objs;
+  out_char(']');
+}
+
+// Items that are not numbers go on their own lines:
+static inline void text_emit_num_array_break(struct ctx *ctx)
+{
+  (void)ctx;
+  out_char('\n');
+}
+
+/* Compact: same notation as text, one line per value */
+
+#define compact_skip_data text_skip_data
+
+static inline void compact_emit_start(struct ctx *ctx, int role)
+{
+  (void)ctx;
+  if (role > 0) out_mem(", ", 2);
+}
+
+static inline void compact_emit_stop(struct ctx *ctx, int role)
+{
+  (void)ctx;
+  if (role == ROLE_MAP_KEY) {
+    out_mem(": ", 2);
+  } else if (role == ROLE_NONE) {
+    out_char('\n');
+  }
+}
+
+#define compact_emit_nil text_emit_nil
+#define compact_emit_bool text_emit_bool
+#define compact_emit_fixint text_emit_fixint
+#define compact_emit_int text_emit_int
+#define compact_emit_uint text_emit_uint
+#define compact_emit_float text_emit_float
+#define compact_emit_str text_emit_str
+#define compact_emit_bin text_emit_bin
+#define compact_emit_ext text_emit_ext
+
+static inline void compact_emit_array_open(struct ctx *ctx, size_t nb_objs)
+{
+  (void)ctx; (void)nb_objs;
+  out_char('[');
+}
+
+static inline void compact_emit_array_close(struct ctx *ctx, size_t nb_objs)
+{
+  (void)ctx; (void)nb_objs;
+  out_char(']');
+}
+
+static inline void compact_emit_map_open(struct ctx *ctx, size_t nb_objs)
+{
+  (void)ctx; (void)nb_objs;
+  out_char('{');
+}
+
+static inline void compact_emit_map_item(struct ctx *ctx, size_t n)
+{
+  (void)ctx;
+  if (n > 0) out_mem(", ", 2);
+}
+
+static inline void compact_emit_map_close(struct ctx *ctx, size_t nb_objs)
+{
+  (void)ctx; (void)nb_objs;
+  out_char('}');
+}
+
+#define compact_emit_num_array_open text_emit_num_array_open
+#define compact_emit_num_run text_emit_num_run
+#define compact_emit_inline_sep text_emit_inline_sep
+#define compact_emit_num_array_close text_emit_num_array_close
+#define compact_emit_num_array_break null_emit_num_array_break
+
+/* JSON: indented, one document per value */
+
+static bool const json_skip_data = false;
+
+// JSON keys must be strings, so other scalars are quoted when used as keys
+// (containers and exts are printed as ndjson then quoted, see STR_KEYS in
+// dump-loop.h):
+static bool json_in_key;
+
+static inline void json_quote_key(void)
+{
+  if (json_in_key) out_char('"');
+}
+
+static struct key_cache json_key_cache;
+
+static inline void json_emit_key_prefix(struct ctx *ctx)
+{
+  (void)ctx;
+}
+
+static inline void json_emit_start(struct ctx *ctx, int role)
+{
+  if (role >= 0) {
+    if (role > 0) out_char(',');
+    out_char('\n');
+    dump_indent(ctx);
+  } else if (role == ROLE_MAP_KEY) {
+    json_in_key = true;
+  }
+}
+
+static inline void json_emit_stop(struct ctx *ctx, int role)
+{
+  (void)ctx;
+  if (role == ROLE_MAP_KEY) {
+    json_in_key = false;
+    out_mem(": ", 2);
+  } else if (role == ROLE_NONE) {
+    out_char('\n');
+  }
+}
+
+static inline void json_emit_nil(struct ctx *ctx)
+{
+  (void)ctx;
+  json_quote_key();
+  out_mem("null", 4);
+  json_quote_key();
+}
+
+static inline void json_emit_bool(struct ctx *ctx, bool b)
+{
+  (void)ctx;
+  json_quote_key();
+  if (b) out_mem("true", 4);
+  else out_mem("false", 5);
+  json_quote_key();
+}
+
+static inline void json_emit_fixint(struct ctx *ctx, unsigned char fst)
+{
+  (void)ctx;
+  json_quote_key();
+  out_fixint(fst);
+  json_quote_key();
+}
+
+static inline void json_emit_int(struct ctx *ctx, int64_t n)
+{
+  (void)ctx;
+  json_quote_key();
+  out_i64(n);
+  json_quote_key();
+}
+
+static inline void json_emit_uint(struct ctx *ctx, uint64_t n)
+{
+  (void)ctx;
+  json_quote_key();
+  out_u64(n);
+  json_quote_key();
+}
+
+static inline void json_emit_float(struct ctx *ctx, double v)
+{
+  (void)ctx;
+  json_quote_key();
+  out_double(v, true);
+  json_quote_key();
+}
+
+static inline void json_emit_str(struct ctx *ctx, char const *data, size_t len)
+{
+  (void)ctx;
+  out_json_str(data, len);
+}
+
+static inline void json_emit_bin(struct ctx *ctx, char const *data, size_t len)
+{
+  (void)ctx;
+  out_char('"');
+  out_hex(data, len, false);
+  out_char('"');
+}
+
+static inline void json_emit_ext(struct ctx *ctx, unsigned char type, char const *data, size_t len)
 {
-  ctx->fd = fd;
-  ctx->offset = 0;
-  ctx->indent = 0;
-  ctx->eof = false;
+  (void)ctx;
+  if (ext_decode(type, data, len)) {
+    out_json_str(ext_text.buf, ext_text.len);
+    return;
+  }
+  out_printf("{\"type\":%d,\"data\":\"", (int8_t)type);
+  out_hex(data, len, false);
+  out_mem("\"}", 2);
 }
 
-#define ROLE_NONE -1
-#define ROLE_MAP_KEY -2
-#define ROLE_MAP_VALUE -3
-// >=0 roles are array indexes
+static inline void json_emit_array_open(struct ctx *ctx, size_t nb_objs)
+{
+  (void)ctx; (void)nb_objs;
+  out_char('[');
+}
+
+static inline void json_emit_array_close(struct ctx *ctx, size_t nb_objs)
+{
+  if (nb_objs > 0) {
+    out_char('\n');
+    dump_indent(ctx);
+  }
+  out_char(']');
+}
 
-static bool dump(struct ctx *, int role);
+static inline void json_emit_map_open(struct ctx *ctx, size_t nb_objs)
+{
+  (void)ctx; (void)nb_objs;
+  out_char('{');
+}
 
-static void dump_indent(struct ctx *ctx)
+static inline void json_emit_map_item(struct ctx *ctx, size_t n)
 {
-  // TODO: faster version
-# define TAB 3
-  for (unsigned t = 0; t < ctx->indent*TAB; t++) printf(" ");
-# undef TAB
+  if (n > 0) out_char(',');
+  out_char('\n');
+  dump_indent(ctx);
 }
 
-static void dump_start(struct ctx *ctx, int role)
+static inline void json_emit_map_close(struct ctx *ctx, size_t nb_objs)
 {
-  if (role != ROLE_MAP_VALUE) {
+  if (nb_objs > 0) {
+    out_char('\n');
     dump_indent(ctx);
   }
-  if (role >= 0) {
-    printf("[%d]: ", role);
-  }
+  out_char('}');
+}
+
+static inline void json_emit_num_array_open(struct ctx *ctx, size_t nb_objs)
+{
+  (void)ctx; (void)nb_objs;
+  out_char('[');
 }
 
-static void dump_stop(struct ctx *ctx, int role)
+static inline void json_emit_num_run(struct ctx *ctx, unsigned char fst, uint64_t const *vals, size_t nb, size_t n)
 {
   (void)ctx;
-  if (role == ROLE_MAP_KEY) {
-    printf(": ");
-  } else {
-    printf("\n");
-  }
+  out_num_run(fst, vals, nb, n, ", ", true);
 }
 
-// Error checked IO
-static bool eread(struct ctx *ctx, void *buf_, size_t sz)
+#define json_emit_inline_sep text_emit_inline_sep
+#define json_emit_num_array_close text_emit_num_array_close
+#define json_emit_num_array_break null_emit_num_array_break
+
+/* NDJSON: one compact JSON document per line */
+
+#define ndjson_skip_data json_skip_data
+
+static struct key_cache ndjson_key_cache;
+
+#define ndjson_emit_key_prefix json_emit_key_prefix
+
+static inline void ndjson_emit_start(struct ctx *ctx, int role)
 {
-  unsigned char *buf = buf_;
-  if (ctx->eof) return false;
+  (void)ctx;
+  if (role > 0) out_char(',');
+  else if (role == ROLE_MAP_KEY) json_in_key = true;
+}
 
-  size_t done = 0;
-  while (done < sz) {
-    ssize_t ret = read(ctx->fd, buf+done, sz-done);
-    if (ret == 0) {
-      ctx->eof = true;
-      return false;
-    } else if (ret < 0) {
-      fprintf(stderr, "Cannot read %zu bytes: %s\n", sz, strerror(errno));
-      return false;
-    }
-    done += ret;
-    ctx->offset += ret;
+static inline void ndjson_emit_stop(struct ctx *ctx, int role)
+{
+  (void)ctx;
+  if (role == ROLE_MAP_KEY) {
+    json_in_key = false;
+    out_char(':');
+  } else if (role == ROLE_NONE) {
+    out_char('\n');
   }
-  return true;
 }
 
+#define ndjson_emit_nil json_emit_nil
+#define ndjson_emit_bool json_emit_bool
+#define ndjson_emit_fixint json_emit_fixint
+#define ndjson_emit_int json_emit_int
+#define ndjson_emit_uint json_emit_uint
+#define ndjson_emit_float json_emit_float
+#define ndjson_emit_str json_emit_str
+#define ndjson_emit_bin json_emit_bin
+#define ndjson_emit_ext json_emit_ext
+#define ndjson_emit_array_open json_emit_array_open
+#define ndjson_emit_array_close compact_emit_array_close
+#define ndjson_emit_map_open json_emit_map_open
 
-static void dump_nil(struct ctx *ctx)
+static inline void ndjson_emit_map_item(struct ctx *ctx, size_t n)
 {
   (void)ctx;
-  printf("()");
+  if (n > 0) out_char(',');
 }
 
-static void dump_false(struct ctx *ctx)
+#define ndjson_emit_map_close compact_emit_map_close
+#define ndjson_emit_num_array_open json_emit_num_array_open
+
+static inline void ndjson_emit_num_run(struct ctx *ctx, unsigned char fst, uint64_t const *vals, size_t nb, size_t n)
 {
   (void)ctx;
-  printf("false");
+  out_num_run(fst, vals, nb, n, ",", true);
 }
 
-static void dump_true(struct ctx *ctx)
+static inline void ndjson_emit_inline_sep(struct ctx *ctx)
 {
   (void)ctx;
-  printf("true");
+  out_char(',');
+}
+
+#define ndjson_emit_num_array_close text_emit_num_array_close
+#define ndjson_emit_num_array_break null_emit_num_array_break
+
+/*
+ * CSV: one row per value
+ *
+ * The elements of a top level array or the values of a top level map (keys
+ * are dropped) are the fields of the row. Containers nested in a field are
+ * printed as in compact mode, within quotes.
+ */
+
+static bool const csv_skip_data = false;
+
+// Set while a top level map key is being skipped:
+static bool csv_mute;
+
+// At depth 1 we are writing the fields themselves, deeper we are within a
+// quoted field:
+static inline void csv_sep(struct ctx *ctx)
+{
+  if (ctx->indent <= 1) out_char(',');
+  else out_mem(", ", 2);
 }
 
-static void dump_int(struct ctx *ctx, int n)
+static inline void csv_emit_start(struct ctx *ctx, int role)
+{
+  if (csv_mute) return;
+  if (role > 0) csv_sep(ctx);
+  else if (role == ROLE_MAP_KEY && ctx->indent == 1) csv_mute = true;
+}
+
+static inline void csv_emit_stop(struct ctx *ctx, int role)
+{
+  if (role == ROLE_MAP_KEY) {
+    if (ctx->indent == 1) csv_mute = false;
+    else if (! csv_mute) out_mem(": ", 2);
+  } else if (role == ROLE_NONE) {
+    out_char('\n');
+  }
+}
+
+static inline void csv_emit_nil(struct ctx *ctx)
+{
+  if (csv_mute) return;
+  if (ctx->indent > 1) out_mem("()", 2);
+}
+
+static inline void csv_emit_bool(struct ctx *ctx, bool b)
+{
+  if (csv_mute) return;
+  text_emit_bool(ctx, b);
+}
+
+static inline void csv_emit_fixint(struct ctx *ctx, unsigned char fst)
+{
+  if (csv_mute) return;
+  text_emit_fixint(ctx, fst);
+}
+
+static inline void csv_emit_int(struct ctx *ctx, int64_t n)
+{
+  if (csv_mute) return;
+  text_emit_int(ctx, n);
+}
+
+static inline void csv_emit_uint(struct ctx *ctx, uint64_t n)
+{
+  if (csv_mute) return;
+  text_emit_uint(ctx, n);
+}
+
+static inline void csv_emit_float(struct ctx *ctx, double v)
+{
+  if (csv_mute) return;
+  text_emit_float(ctx, v);
+}
+
+static inline void csv_emit_str(struct ctx *ctx, char const *data, size_t len)
+{
+  if (csv_mute) return;
+  if (ctx->indent > 1) out_char('"');
+  out_char('"');
+  out_utf8(data, len, out_csv_str, false);
+  out_char('"');
+  if (ctx->indent > 1) out_char('"');
+}
+
+static inline void csv_emit_bin(struct ctx *ctx, char const *data, size_t len)
 {
   (void)ctx;
-  printf("%d", n);
+  if (csv_mute) return;
+  out_hex(data, len, false);
 }
 
-static bool read_varint(struct ctx *ctx, uint64_t *n, size_t lenlen, bool sign)
+static inline void csv_emit_ext(struct ctx *ctx, unsigned char type, char const *data, size_t len)
 {
-  *n = 0;
-  unsigned char byte;
-  for (unsigned cb = 0; cb < lenlen; cb++) {
-    *n <<= 8;  // big endian is not dead
-    if (! eread(ctx, &byte, 1)) return false;
-    *n |= byte;
+  if (csv_mute) return;
+  if (ext_decode(type, data, len)) {
+    csv_emit_str(ctx, ext_text.buf, ext_text.len);
+    return;
   }
-  if (sign) {
-    uint64_t sign_extend = ~0ULL << lenlen;
-    if (byte >= 128) *n |= sign_extend;
+  out_printf("Type%d:", (int8_t)type);
+  out_hex(data, len, false);
+}
+
+static inline void csv_open(struct ctx *ctx, char c)
+{
+  if (csv_mute || ctx->indent == 0) return;
+  if (ctx->indent == 1) out_char('"');
+  out_char(c);
+}
+
+static inline void csv_close(struct ctx *ctx, char c)
+{
+  if (csv_mute || ctx->indent == 0) return;
+  out_char(c);
+  if (ctx->indent == 1) out_char('"');
+}
+
+static inline void csv_emit_array_open(struct ctx *ctx, size_t nb_objs)
+{
+  (void)nb_objs;
+  csv_open(ctx, '[');
+}
+
+static inline void csv_emit_array_close(struct ctx *ctx, size_t nb_objs)
+{
+  (void)nb_objs;
+  csv_close(ctx, ']');
+}
+
+static inline void csv_emit_map_open(struct ctx *ctx, size_t nb_objs)
+{
+  (void)nb_objs;
+  csv_open(ctx, '{');
+}
+
+static inline void csv_emit_map_item(struct ctx *ctx, size_t n)
+{
+  if (csv_mute) return;
+  if (n > 0) csv_sep(ctx);
+}
+
+static inline void csv_emit_map_close(struct ctx *ctx, size_t nb_objs)
+{
+  (void)nb_objs;
+  csv_close(ctx, '}');
+}
+
+#define csv_emit_num_array_open csv_emit_array_open
+
+static inline void csv_emit_num_run(struct ctx *ctx, unsigned char fst, uint64_t const *vals, size_t nb, size_t n)
+{
+  if (csv_mute) return;
+  out_num_run(fst, vals, nb, n, ctx->indent <= 1 ? "," : ", ", false);
+}
+
+static inline void csv_emit_inline_sep(struct ctx *ctx)
+{
+  if (csv_mute) return;
+  csv_sep(ctx);
+}
+
+#define csv_emit_num_array_close csv_emit_array_close
+#define csv_emit_num_array_break null_emit_num_array_break
+
+/* Null: decode only */
+
+static bool const null_skip_data = true;
+
+static inline void null_emit_start(struct ctx *ctx, int role) { (void)ctx; (void)role; }
+static inline void null_emit_stop(struct ctx *ctx, int role) { (void)ctx; (void)role; }
+static inline void null_emit_nil(struct ctx *ctx) { (void)ctx; }
+static inline void null_emit_bool(struct ctx *ctx, bool b) { (void)ctx; (void)b; }
+static inline void null_emit_fixint(struct ctx *ctx, unsigned char fst) { (void)ctx; (void)fst; }
+static inline void null_emit_int(struct ctx *ctx, int64_t n) { (void)ctx; (void)n; }
+static inline void null_emit_uint(struct ctx *ctx, uint64_t n) { (void)ctx; (void)n; }
+static inline void null_emit_float(struct ctx *ctx, double v) { (void)ctx; (void)v; }
+static inline void null_emit_str(struct ctx *ctx, char const *d, size_t l) { (void)ctx; (void)d; (void)l; }
+static inline void null_emit_bin(struct ctx *ctx, char const *d, size_t l) { (void)ctx; (void)d; (void)l; }
+static inline void null_emit_ext(struct ctx *ctx, unsigned char t, char const *d, size_t l) { (void)ctx; (void)t; (void)d; (void)l; }
+static inline void null_emit_array_open(struct ctx *ctx, size_t nb_objs) { (void)ctx; (void)nb_objs; }
+static inline void null_emit_array_close(struct ctx *ctx, size_t nb_objs) { (void)ctx; (void)nb_objs; }
+static inline void null_emit_map_open(struct ctx *ctx, size_t nb_objs) { (void)ctx; (void)nb_objs; }
+static inline void null_emit_map_item(struct ctx *ctx, size_t n) { (void)ctx; (void)n; }
+static inline void null_emit_map_close(struct ctx *ctx, size_t nb_objs) { (void)ctx; (void)nb_objs; }
+static inline void null_emit_num_array_open(struct ctx *ctx, size_t nb_objs) { (void)ctx; (void)nb_objs; }
+static inline void null_emit_num_run(struct ctx *ctx, unsigned char fst, uint64_t const *vals, size_t nb, size_t n) { (void)ctx; (void)fst; (void)vals; (void)nb; (void)n; }
+static inline void null_emit_inline_sep(struct ctx *ctx) { (void)ctx; }
+static inline void null_emit_num_array_close(struct ctx *ctx, size_t nb_objs) { (void)ctx; (void)nb_objs; }
+static inline void null_emit_num_array_break(struct ctx *ctx) { (void)ctx; }
+
+/*
+ * Tape
+ *
+ * Flat representation of a whole input, built in one pass by the "tape"
+ * mode, so that several queries can then be run without parsing msgpack
+ * headers again.
+ *
+ * Every value is one 64 bits word holding its tag in the top byte and the
+ * offset of that tag in the input below. Containers are followed by a
+ * second word holding the tape index past their last item, so that they
+ * can be skipped in O(1).
+ */
+
+#define TAPE_TAG(w) ((unsigned char)((w) >> 56))
+#define TAPE_OFFSET(w) ((size_t)((w) & ((1ULL << 56) - 1)))
+
+struct tape {
+  uint64_t *words;
+  size_t len, cap;
+};
+
+// The tape being built:
+static struct tape *tape;
+// Index of the second word of the containers being built, per depth:
+static size_t *tape_opens;
+static size_t tape_opens_cap;
+
+static void tape_push(uint64_t w)
+{
+  if (tape->len >= tape->cap) {
+    size_t cap = tape->cap ? tape->cap * 2 : 4096;
+    uint64_t *words = realloc(tape->words, cap * sizeof(*words));
+    if (! words) {
+      fprintf(stderr, "Cannot alloc %zu bytes for the tape\n", cap * sizeof(*words));
+      exit(1);
+    }
+    tape->words = words;
+    tape->cap = cap;
   }
-  return true;
+  tape->words[tape->len++] = w;
 }
-static bool read_varuint(struct ctx *ctx, uint64_t *n, size_t lenlen)
+
+static bool tape_is_container(unsigned char fst)
 {
-  return read_varint(ctx, n, lenlen, false);
+  return (fst & 0xe0) == 0x80 || (fst >= 0xdc && fst <= 0xdf);
 }
 
-static bool dump_varint(struct ctx *ctx, size_t lenlen, bool sign)
+// Index of whatever follows the value at i:
+static size_t tape_next(struct tape const *t, size_t i)
 {
-  uint64_t n;
-  if (! read_varint(ctx, &n, lenlen, sign)) return false;
+  return tape_is_container(TAPE_TAG(t->words[i])) ? t->words[i + 1] : i + 1;
+}
 
-  if (sign) {
-    printf("%"PRId64, (int64_t)n);
-  } else {
-    printf("%"PRIu64, n);
+static bool const tape_skip_data = true;
+
+static inline void tape_emit_start(struct ctx *ctx, int role)
+{
+  (void)role;
+  // Tag has just been read:
+  tape_push((uint64_t)ctx->ibuf[ctx->ipos - 1] << 56 | (ctx->offset - 1));
+}
+
+static inline void tape_open(struct ctx *ctx)
+{
+  if (ctx->indent >= tape_opens_cap) {
+    size_t cap = tape_opens_cap ? tape_opens_cap * 2 : 64;
+    size_t *opens = realloc(tape_opens, cap * sizeof(*opens));
+    if (! opens) {
+      fprintf(stderr, "Cannot alloc %zu bytes for the tape\n", cap * sizeof(*opens));
+      exit(1);
+    }
+    tape_opens = opens;
+    tape_opens_cap = cap;
   }
-  return true;
+  tape_opens[ctx->indent] = tape->len;
+  tape_push(0);
 }
 
-static bool dump_varuint(struct ctx *ctx, size_t b) { return dump_varint(ctx, b, false); }
-static bool dump_varsint(struct ctx *ctx, size_t b) { return dump_varint(ctx, b, true); }
-static bool dump_uint8(struct ctx *ctx) { return dump_varuint(ctx, 1); }
-static bool dump_uint16(struct ctx *ctx) { return dump_varuint(ctx, 2); }
-static bool dump_uint32(struct ctx *ctx) { return dump_varuint(ctx, 4); }
-static bool dump_uint64(struct ctx *ctx) { return dump_varuint(ctx, 8); }
-static bool dump_int8(struct ctx *ctx) { return dump_varsint(ctx, 1); }
-static bool dump_int16(struct ctx *ctx) { return dump_varsint(ctx, 2); }
-static bool dump_int32(struct ctx *ctx) { return dump_varsint(ctx, 4); }
-static bool dump_int64(struct ctx *ctx) { return dump_varsint(ctx, 8); }
+static inline void tape_close(struct ctx *ctx)
+{
+  tape->words[tape_opens[ctx->indent]] = tape->len;
+}
 
-static bool dump_float32(struct ctx *ctx)
+static inline void tape_emit_stop(struct ctx *ctx, int role) { (void)ctx; (void)role; }
+#define tape_emit_nil null_emit_nil
+#define tape_emit_bool null_emit_bool
+#define tape_emit_fixint null_emit_fixint
+#define tape_emit_int null_emit_int
+#define tape_emit_uint null_emit_uint
+#define tape_emit_float null_emit_float
+#define tape_emit_str null_emit_str
+#define tape_emit_bin null_emit_bin
+#define tape_emit_ext null_emit_ext
+static inline void tape_emit_array_open(struct ctx *ctx, size_t nb_objs) { (void)nb_objs; tape_open(ctx); }
+static inline void tape_emit_array_close(struct ctx *ctx, size_t nb_objs) { (void)nb_objs; tape_close(ctx); }
+#define tape_emit_map_open tape_emit_array_open
+#define tape_emit_map_item null_emit_map_item
+#define tape_emit_map_close tape_emit_array_close
+#define tape_emit_num_array_open tape_emit_array_open
+
+// Numbers of a run have been consumed already:
+static inline void tape_emit_num_run(struct ctx *ctx, unsigned char fst, uint64_t const *vals, size_t nb, size_t n)
 {
-  float v;
-  assert(sizeof(v) == 4);
-  if (! eread(ctx, &v, sizeof(v))) return false;
-  printf("%g", v);
-  return true;
+  (void)vals; (void)n;
+  size_t const stride = 1 + num_width(fst);
+  for (size_t i = nb; i > 0; i--) {
+    tape_push((uint64_t)ctx->ibuf[ctx->ipos - i*stride] << 56 | (ctx->offset - i*stride));
+  }
 }
 
-static bool dump_float64(struct ctx *ctx)
+#define tape_emit_inline_sep null_emit_inline_sep
+#define tape_emit_num_array_close tape_emit_array_close
+#define tape_emit_num_array_break null_emit_num_array_break
+
+static struct shapes text_shapes, compact_shapes, json_shapes, ndjson_shapes, csv_shapes;
+
+#define MODE text
+#define KEY_CACHE (&text_key_cache)
+#define SHAPES (&text_shapes)
+#include "dump-loop.h"
+#define MODE compact
+#define SHAPES (&compact_shapes)
+#include "dump-loop.h"
+static bool ndjson_dump(struct ctx *, int role);
+#define MODE json
+#define KEY_CACHE (&json_key_cache)
+#define STR_KEYS ndjson_dump
+#define SHAPES (&json_shapes)
+#include "dump-loop.h"
+#define MODE ndjson
+#define KEY_CACHE (&ndjson_key_cache)
+#define STR_KEYS ndjson_dump
+#define SHAPES (&ndjson_shapes)
+#include "dump-loop.h"
+#define MODE csv
+#define SHAPES (&csv_shapes)
+#include "dump-loop.h"
+#define MODE null
+#include "dump-loop.h"
+#define MODE tape
+#include "dump-loop.h"
+
+static struct mode {
+  char const *name;
+  bool (*dump)(struct ctx *, int role);
+  // Same for a top level value:
+  bool (*dump_record)(struct ctx *);
+} const modes[] = {
+  { "text", text_dump, text_dump_record },
+  { "compact", compact_dump, compact_dump_record },
+  { "json", json_dump, json_dump_record },
+  { "ndjson", ndjson_dump, ndjson_dump_record },
+  { "csv", csv_dump, csv_dump_record },
+  { "null", null_dump, null_dump_record },
+};
+
+static struct mode const *mode_of_name(char const *name)
 {
-  double v;
-  assert(sizeof(v) == 8);
-  if (! eread(ctx, &v, sizeof(v))) return false;
-  printf("%g", v);
-  return true;
+  for (unsigned m = 0; m < sizeof(modes)/sizeof(modes[0]); m++) {
+    if (0 == strcmp(name, modes[m].name)) return modes + m;
+  }
+  return NULL;
 }
 
-static bool dump_data(struct ctx *ctx, bool is_str, size_t len)
+/*
+ * Queries
+ *
+ * A query is a path of dot separated map keys or array indices, "*"
+ * matching any of them. Every value matching the path from the top level
+ * values is printed.
+ */
+
+struct query {
+  char const *path;
+  unsigned nb_segs;
+  struct segment {
+    char const *key;
+    size_t len;
+    bool any;
+    bool is_index;
+    uint64_t index;
+  } *segs;
+};
+
+static bool query_ctor(struct query *q, char const *path)
 {
-  char *data = malloc(len);
-  if (! data) {
-    fprintf(stderr, "Cannot alloc %zu bytes", len);
+  q->path = path;
+  q->nb_segs = 0;
+  if (path[0] == '.') path++;
+  size_t max = 1;
+  for (char const *c = path; *c; c++) if (*c == '.') max++;
+  q->segs = malloc(max * sizeof(*q->segs));
+  if (! q->segs) {
+    fprintf(stderr, "Cannot alloc %zu bytes", max * sizeof(*q->segs));
     return false;
   }
-  if (! eread(ctx, data, len)) {
-    free(data);
-    return false;
+
+  while (*path) {
+    struct segment *s = q->segs + q->nb_segs++;
+    s->key = path;
+    s->len = strcspn(path, ".");
+    s->any = s->len == 1 && path[0] == '*';
+    s->is_index = s->len > 0 && strspn(path, "0123456789") == s->len;
+    s->index = s->is_index ? strtoull(path, NULL, 10) : 0;
+    path += s->len;
+    if (*path == '.') path++;
   }
+  return true;
+}
+
+static void query_dtor(struct query *q)
+{
+  free(q->segs);
+  q->segs = NULL;
+}
 
-  if (is_str) {
-    printf("\"%.*s\"", (int)len, data);
+// Tell if the value at offset off of data is a str equal to the segment.
+static bool key_matches(unsigned char const *data, size_t off, struct segment const *s)
+{
+  unsigned char fst = data[off];
+  size_t len, lenlen;
+  if ((fst & 0xe0) == 0xa0) {
+    len = fst & 0x1f;
+    lenlen = 0;
+  } else if (fst >= 0xd9 && fst <= 0xdb) {
+    lenlen = 1 << (fst - 0xd9);
+    len = 0;
+    for (size_t i = 0; i < lenlen; i++) len = (len << 8) | data[off + 1 + i];
   } else {
-    for (unsigned n = 0; n < len; n++) {
-      printf("%s%02x", n > 0 ? " ":"", data[n]);
+    return false;
+  }
+  return len == s->len && 0 == memcmp(data + off + 1 + lenlen, s->key, len);
+}
+
+static bool extract_enter(struct ctx *ctx, uint64_t n, bool is_map)
+{
+  unsigned const seg = ctx->indent - 1;
+  if (extract.depth != seg || seg >= extract.nb_segs) return false;
+  struct segment const *s = extract.path->segs + seg;
+  if (! s->any) {
+    if (is_map) {
+      // Peek at the whole key, as key_matches wants it:
+      unsigned char const *p = epeek(ctx, 1);
+      if (! p) return false;
+      size_t len = 1;
+      if ((p[0] & 0xe0) == 0xa0) {
+        len += p[0] & 0x1f;
+      } else if (p[0] >= 0xd9 && p[0] <= 0xdb) {
+        size_t const lenlen = 1 << (p[0] - 0xd9);
+        if (! (p = epeek(ctx, 1 + lenlen))) return false;
+        len += lenlen + load_be(p + 1, lenlen);
+      } else {
+        return false;
+      }
+      if (! (p = epeek(ctx, len)) || ! key_matches(p, 0, s)) return false;
+    } else if (! s->is_index || s->index != n) {
+      return false;
     }
   }
-  free(data);
+  extract.depth ++;
   return true;
 }
 
-static bool dump_data_var(struct ctx *ctx, bool is_str, size_t lenlen)
+// Print every value matching the query segments from seg onward, starting
+// from the value at tape index i.
+static bool query_run(struct query const *q, unsigned seg, struct tape const *t, size_t i, struct ctx *ctx, struct mode const *mode)
 {
-  uint64_t len;
-  if (! read_varuint(ctx, &len, lenlen)) return false;
-  return dump_data(ctx, is_str, len);
+  uint64_t w = t->words[i];
+  if (seg >= q->nb_segs) {
+    ctx_seek_mem(ctx, TAPE_OFFSET(w));
+    bool ok = mode->dump(ctx, ROLE_NONE);
+    arena_reset(&arena);
+    return ok;
+  }
+
+  unsigned char fst = TAPE_TAG(w);
+  if (! tape_is_container(fst)) return true;
+  struct segment const *s = q->segs + seg;
+  size_t const end = t->words[i + 1];
+  bool const is_map = (fst & 0xf0) == 0x80 || fst == 0xde || fst == 0xdf;
+
+  uint64_t idx = 0;
+  for (size_t j = i + 2; j < end; idx++) {
+    size_t v = j;
+    if (is_map) {
+      v = tape_next(t, j);
+      if (s->any || key_matches(ctx->ibuf, TAPE_OFFSET(t->words[j]), s)) {
+        if (! query_run(q, seg + 1, t, v, ctx, mode)) return false;
+      }
+    } else if (s->any || (s->is_index && s->index == idx)) {
+      if (! query_run(q, seg + 1, t, v, ctx, mode)) return false;
+      if (! s->any) break;
+    }
+    j = tape_next(t, v);
+  }
+  return true;
 }
 
-static bool dump_array(struct ctx *ctx, size_t nb_objs)
+// Load the whole input in memory, mapping it if possible.
+static bool load_input(int fd, unsigned char **data, size_t *size, bool *mapped)
 {
-  printf("[\n");
-  ctx->indent ++;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m != MAP_FAILED) {
+      *data = m;
+      *size = st.st_size;
+      *mapped = true;
+      stats.bytes_in += *size;
+      return true;
+    }
+  }
 
-  for (unsigned n = 0; n < nb_objs; n++) {
-    if (! dump(ctx, n)) return false;
+  *mapped = false;
+  *data = NULL;
+  *size = 0;
+  size_t cap = 0;
+  while (true) {
+    if (*size == cap) {
+      cap = cap ? cap * 2 : IBUF_SIZE;
+      unsigned char *d = realloc(*data, cap);
+      if (! d) {
+        fprintf(stderr, "Cannot alloc %zu bytes", cap);
+        free(*data);
+        return false;
+      }
+      *data = d;
+    }
+    ssize_t ret = do_read(fd, *data + *size, cap - *size);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0) {
+      fprintf(stderr, "Cannot read: %s\n", strerror(errno));
+      free(*data);
+      return false;
+    }
+    if (ret == 0) return true;
+    *size += ret;
   }
+}
 
-  ctx->indent--;
-  dump_indent(ctx);
-  printf("]");
-  return true;
+/*
+ * Tape cache
+ *
+ * The tape of a file can be saved next to it (as FILE.tape) and mapped by
+ * later runs instead of being built again. It is identified by the inode,
+ * size and mtime of the file, and a hash of its first and last blocks.
+ */
+
+#define TAPE_MAGIC "MPDTAPE1"
+#define TAPE_HASH_BLOCK 4096
+
+struct tape_header {
+  char magic[8];
+  uint64_t ino, size, mtime_sec, mtime_nsec;
+  uint64_t hash;
+  uint64_t len;  // Number of words that follow
+};
+
+// FNV-1a
+static uint64_t hash_bytes(uint64_t h, unsigned char const *data, size_t len)
+{
+  for (size_t i = 0; i < len; i++) h = (h ^ data[i]) * 0x100000001b3ULL;
+  return h;
 }
 
-static bool dump_array_var(struct ctx *ctx, size_t lenlen)
+static void tape_header_ctor(struct tape_header *h, struct stat const *st, unsigned char const *data, size_t size)
 {
-  uint64_t len;
-  if (! read_varuint(ctx, &len, lenlen)) return false;
-  return dump_array(ctx, len);
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, TAPE_MAGIC, sizeof(h->magic));
+  h->ino = st->st_ino;
+  h->size = st->st_size;
+  h->mtime_sec = st->st_mtim.tv_sec;
+  h->mtime_nsec = st->st_mtim.tv_nsec;
+  size_t n = size < TAPE_HASH_BLOCK ? size : TAPE_HASH_BLOCK;
+  h->hash = hash_bytes(0xcbf29ce484222325ULL, data, n);
+  h->hash = hash_bytes(h->hash, data + size - n, n);
 }
 
-static bool dump_map(struct ctx *ctx, size_t nb_objs)
+// A cache can match the header of the file and still be corrupt. Check
+// that every word points at its tag in the data, that scalars fit in the
+// data, and that containers end within their parent, past their own
+// words, with an even number of items for maps, before trusting it.
+struct tape_level {
+  size_t end;
+  uint64_t nb_items;
+  bool is_map;
+};
+
+static bool tape_check(struct tape const *t, unsigned char const *data, size_t size)
 {
-  printf("{\n");
-  ctx->indent ++;
+  struct tape_level *levels = NULL;
+  size_t depth = 0, levels_cap = 0;
+  struct tape_level top = { t->len, 0, false };
+  struct tape_level *l = &top;
+  bool ok = false;
+
+  for (size_t i = 0; ; ) {
+    // Close the containers ending here:
+    while (depth > 0 && i == l->end) {
+      if (l->is_map && l->nb_items % 2) goto quit;
+      depth --;
+      l = depth > 0 ? levels + depth - 1 : &top;
+    }
+    if (i == t->len) break;
 
-  for (unsigned n = 0; n < nb_objs; n++) {
-    if (! dump(ctx, ROLE_MAP_KEY)) return false;
-    if (! dump(ctx, ROLE_MAP_VALUE)) return false;
+    uint64_t const w = t->words[i];
+    size_t const off = TAPE_OFFSET(w);
+    unsigned char const fst = TAPE_TAG(w);
+    if (off >= size || data[off] != fst) goto quit;
+    l->nb_items ++;
+    if (! tape_is_container(fst)) {
+      // 0 for exts, which are only ever decoded with bound checks:
+      size_t const sz = scalar_size(data + off, size - off);
+      if (sz > size - off) goto quit;
+      i ++;
+      continue;
+    }
+
+    if (i + 1 >= l->end) goto quit;
+    uint64_t const end = t->words[i + 1];
+    if (end < i + 2 || end > l->end) goto quit;
+    if (depth >= levels_cap) {
+      size_t cap = levels_cap ? levels_cap * 2 : 64;
+      struct tape_level *lv = realloc(levels, cap * sizeof(*lv));
+      if (! lv) goto quit;
+      levels = lv;
+      levels_cap = cap;
+    }
+    l = levels + depth ++;
+    l->end = end;
+    l->nb_items = 0;
+    l->is_map = (fst & 0xf0) == 0x80 || fst == 0xde || fst == 0xdf;
+    i += 2;
   }
+  ok = true;
 
-  ctx->indent --;
-  dump_indent(ctx);
-  printf("}");
-  return true;
+quit:
+  free(levels);
+  return ok;
 }
 
-static bool dump_map_var(struct ctx *ctx, size_t lenlen)
+// Map the cached tape if it matches the file. Then t->words points into
+// the mapping.
+static bool tape_cache_load(char const *cache_name, struct tape_header const *expected, unsigned char const *data, struct tape *t, void **map, size_t *map_len)
 {
-  uint64_t len;
-  if (! read_varuint(ctx, &len, lenlen)) return false;
-  return dump_map(ctx, len);
+  int fd = open(cache_name, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  bool ok = false;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*expected)) {
+    *map_len = st.st_size;
+    *map = mmap(NULL, *map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (*map != MAP_FAILED) {
+      struct tape_header const *h = *map;
+      ok =
+        0 == memcmp(h, expected, offsetof(struct tape_header, len)) &&
+        h->len == (*map_len - sizeof(*h)) / sizeof(uint64_t);
+      struct tape const cached = { (uint64_t *)(h + 1), h->len, h->len };
+      if (ok && ! tape_check(&cached, data, expected->size)) {
+        fprintf(stderr, "Ignoring corrupt tape cache '%s'\n", cache_name);
+        ok = false;
+      }
+      if (ok) *t = cached;
+      else munmap(*map, *map_len);
+    }
+  }
+  close(fd);
+  return ok;
 }
 
-static bool dump_ext(struct ctx *ctx, size_t len)
+static void tape_cache_save(char const *cache_name, struct tape_header *h, struct tape const *t)
 {
-  unsigned char type;
-  if (! eread(ctx, &type, 1)) return false;
-  printf("Type%d:", type);
-  dump_data(ctx, false, len);
-  return true;
+  char tmp_name[PATH_MAX];
+  if ((size_t)snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", cache_name) >= sizeof(tmp_name)) return;
+  int fd = open(tmp_name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot create tape cache '%s': %s\n", tmp_name, strerror(errno));
+    return;
+  }
+  h->len = t->len;
+  bool ok =
+    write_all(fd, (char const *)h, sizeof(*h), tmp_name) &&
+    write_all(fd, (char const *)t->words, t->len * sizeof(uint64_t), tmp_name);
+  if (close(fd) != 0) {
+    fprintf(stderr, "Cannot write tape cache '%s': %s\n", tmp_name, strerror(errno));
+    ok = false;
+  }
+  // Only a complete cache gets its final name:
+  if (ok && rename(tmp_name, cache_name) != 0) {
+    fprintf(stderr, "Cannot rename tape cache '%s' to '%s': %s\n", tmp_name, cache_name, strerror(errno));
+    ok = false;
+  }
+  if (! ok) unlink(tmp_name);
 }
-static bool dump_ext_var(struct ctx *ctx, size_t lenlen)
-{
-  uint64_t len;
-  if (! read_varuint(ctx, &len, lenlen)) return false;
-  return dump_ext(ctx, len);
-}
-
-static bool dump(struct ctx *ctx, int role)
-{
-  unsigned char fst;
-  if (! eread(ctx, &fst, 1)) return ctx->eof;
-
-  dump_start(ctx, role);
-
-  if (fst == 0xc0) dump_nil(ctx);
-  else if (fst == 0xc2) dump_false(ctx);
-  else if (fst == 0xc3) dump_true(ctx);
-  else if ((fst & 0x80) == 0) dump_int(ctx, fst);
-  else if ((fst & 0xe0) == 0xe0) dump_int(ctx, fst);
-  else if (fst == 0xcc) {
-    if (! dump_uint8(ctx)) return false;
-  } else if (fst == 0xcd) {
-    if (! dump_uint16(ctx)) return false;
-  } else if (fst == 0xce) {
-    if (! dump_uint32(ctx)) return false;
-  } else if (fst == 0xcf) {
-    if (! dump_uint64(ctx)) return false;
-  } else if (fst == 0xd0) {
-    if (! dump_int8(ctx)) return false;
-  } else if (fst == 0xd1) {
-    if (! dump_int16(ctx)) return false;
-  } else if (fst == 0xd2) {
-    if (! dump_int32(ctx)) return false;
-  } else if (fst == 0xd3) {
-    if (! dump_int64(ctx)) return false;
-  } else if (fst == 0xca) {
-    if (! dump_float32(ctx)) return false;
-  } else if (fst == 0xcb) {
-    if (! dump_float64(ctx)) return false;
-  } else if ((fst & 0xe0) == 0xa0) {
-    if (! dump_data(ctx, true, fst & 0x1f)) return false;
-  } else if (fst == 0xd9) {
-    if (! dump_data_var(ctx, true, 1)) return false;
-  } else if (fst == 0xda) {
-    if (! dump_data_var(ctx, true, 2)) return false;
-  } else if (fst == 0xdb) {
-    if (! dump_data_var(ctx, true, 4)) return false;
-  } else if (fst == 0xc4) {
-    if (! dump_data_var(ctx, false, 1)) return false;
-  } else if (fst == 0xc5) {
-    if (! dump_data_var(ctx, false, 2)) return false;
-  } else if (fst == 0xc6) {
-    if (! dump_data_var(ctx, false, 4)) return false;
-  } else if ((fst & 0xf0) == 0x90) {
-    if (! dump_array(ctx, fst & 0x0f)) return false;
-  } else if (fst == 0xdc) {
-    if (! dump_array_var(ctx, 2)) return false;
-  } else if (fst == 0xdd) {
-    if (! dump_array_var(ctx, 4)) return false;
-  } else if ((fst & 0xf0) == 0x80) {
-    if (! dump_map(ctx, fst & 0x0f)) return false;
-  } else if (fst == 0xde) {
-    if (! dump_map_var(ctx, 2)) return false;
-  } else if (fst == 0xdf) {
-    if (! dump_map_var(ctx, 4)) return false;
-  } else if (fst == 0xd4) {
-    if (! dump_ext(ctx, 1)) return false;
-  } else if (fst == 0xd5) {
-    if (! dump_ext(ctx, 2)) return false;
-  } else if (fst == 0xd6) {
-    if (! dump_ext(ctx, 4)) return false;
-  } else if (fst == 0xd7) {
-    if (! dump_ext(ctx, 8)) return false;
-  } else if (fst == 0xd8) {
-    if (! dump_ext(ctx, 16)) return false;
-  } else if (fst == 0xc7) {
-    if (! dump_ext_var(ctx, 1)) return false;
-  } else if (fst == 0xc8) {
-    if (! dump_ext_var(ctx, 2)) return false;
-  } else if (fst == 0xc9) {
-    if (! dump_ext_var(ctx, 4)) return false;
-  } else {
-    fprintf(stderr, "Bad tag %02x\n", fst);
-    return false;
+
+static bool run_queries(int fd, char const *fname, bool use_cache, struct query const *queries, unsigned nb_queries, struct mode const *mode)
+{
+  unsigned char *data;
+  size_t size;
+  bool mapped;
+  if (! load_input(fd, &data, &size, &mapped)) return false;
+
+  struct tape t = { NULL, 0, 0 };
+  struct ctx ctx;
+  ctx_ctor_mem(&ctx, data, size);
+  bool ok = true;
+
+  // Only regular files can be cached:
+  struct stat st;
+  use_cache = use_cache && mapped && fstat(fd, &st) == 0;
+  struct tape_header header;
+  char cache_name[PATH_MAX];
+  void *cache_map = NULL;
+  size_t cache_len = 0;
+  if (use_cache) {
+    tape_header_ctor(&header, &st, data, size);
+    if ((size_t)snprintf(cache_name, sizeof(cache_name), "%s.tape", fname) >= sizeof(cache_name)) {
+      use_cache = false;
+    } else if (! tape_cache_load(cache_name, &header, data, &t, &cache_map, &cache_len)) {
+      cache_map = NULL;
+    }
   }
-  
-  dump_stop(ctx, role);
-  return true;
+
+  if (! cache_map) {
+    tape = &t;
+    while (ok && ! ctx.eof) {
+      size_t const offset = ctx.offset;
+      uint64_t const start = latency.enabled ? now_ns() : 0;
+      ok = tape_dump(&ctx, ROLE_NONE);
+      if (latency.enabled && ! ctx.eof) lat_record(now_ns() - start, offset);
+      progress_tick(&ctx);
+    }
+    if (ok && use_cache) tape_cache_save(cache_name, &header, &t);
+  }
+
+  for (unsigned q = 0; ok && q < nb_queries; q++) {
+    for (size_t i = 0; ok && i < t.len; i = tape_next(&t, i)) {
+      ok = query_run(queries + q, 0, &t, i, &ctx, mode);
+      if (q == 0) stats_tick();
+    }
+  }
+
+  tape = NULL;
+  if (cache_map) munmap(cache_map, cache_len);
+  else free(t.words);
+  free(tape_opens);
+  tape_opens = NULL;
+  tape_opens_cap = 0;
+  ctx_dtor(&ctx);
+  if (mapped) munmap(data, size);
+  else free(data);
+  return ok;
+}
+
+static void usage(char const *prog)
+{
+  printf("%s [-m|--mode text|compact|json|ndjson|csv|null] [-q|--query PATH]... [-c|--tape-cache] [-H|--huge-pages] [-s|--stats-stderr[=SECONDS]] [-p|--progress=SECONDS] [-l|--latency] [-P|--perf-counters[=phases]] [-u|--invalid-utf8=replace|escape|fail] [-e|--ext-plugins DIR] [-n|--decode-nested[=bin,TYPE...]] [-x|--extract-bin PATH [-o|--out-dir DIR]] [file]\n", prog);
 }
 
 int main(int nb_args, char **args)
 {
+  struct mode const *mode = modes;
+  struct query *queries = NULL;
+  unsigned nb_queries = 0;
+  bool use_tape_cache = false;
+  char const *ext_plugins_dir = NULL;
+  static struct query extract_path;
+
+  static struct option const options[] = {
+    { "mode", required_argument, NULL, 'm' },
+    { "query", required_argument, NULL, 'q' },
+    { "tape-cache", no_argument, NULL, 'c' },
+    { "huge-pages", no_argument, NULL, 'H' },
+    { "stats-stderr", optional_argument, NULL, 's' },
+    { "progress", required_argument, NULL, 'p' },
+    { "latency", no_argument, NULL, 'l' },
+    { "perf-counters", optional_argument, NULL, 'P' },
+    { "invalid-utf8", required_argument, NULL, 'u' },
+    { "ext-plugins", required_argument, NULL, 'e' },
+    { "decode-nested", optional_argument, NULL, 'n' },
+    { "extract-bin", required_argument, NULL, 'x' },
+    { "out-dir", required_argument, NULL, 'o' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  int opt;
+  while ((opt = getopt_long(nb_args, args, "m:q:cHs::p:lP::u:e:n::x:o:h", options, NULL)) != -1) {
+    switch (opt) {
+      case 'm':
+        mode = mode_of_name(optarg);
+        if (! mode) {
+          fprintf(stderr, "Unknown mode '%s'\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'q':
+        queries = realloc(queries, (nb_queries + 1) * sizeof(*queries));
+        if (! queries) {
+          fprintf(stderr, "Cannot alloc %zu bytes", (nb_queries + 1) * sizeof(*queries));
+          exit(1);
+        }
+        if (! query_ctor(queries + nb_queries, optarg)) exit(1);
+        nb_queries ++;
+        break;
+      case 'c':
+        use_tape_cache = true;
+        break;
+      case 'H':
+        arena.huge_pages = true;
+        break;
+      case 's':
+        stats.enabled = true;
+        if (optarg) stats.interval = strtoul(optarg, NULL, 10);
+        break;
+      case 'p':
+        progress.interval = strtoul(optarg, NULL, 10);
+        break;
+      case 'l':
+        latency.enabled = true;
+        break;
+      case 'P':
+        perf.enabled = true;
+        if (optarg && 0 == strcmp(optarg, "phases")) {
+          perf.phases = true;
+        } else if (optarg) {
+          fprintf(stderr, "Unknown perf counters option '%s'\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'u':
+        if (0 == strcmp(optarg, "replace")) utf8_policy = UTF8_REPLACE;
+        else if (0 == strcmp(optarg, "escape")) utf8_policy = UTF8_ESCAPE;
+        else if (0 == strcmp(optarg, "fail")) utf8_policy = UTF8_FAIL;
+        else {
+          fprintf(stderr, "Unknown invalid UTF-8 policy '%s'\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'e':
+        ext_plugins_dir = optarg;
+        break;
+      case 'n':
+        if (! nested_parse(optarg)) exit(1);
+        break;
+      case 'x':
+        if (! query_ctor(&extract_path, optarg)) exit(1);
+        extract.path = &extract_path;
+        extract.nb_segs = extract_path.nb_segs;
+        break;
+      case 'o':
+        extract.dir = optarg;
+        break;
+      case 'h':
+        usage(args[0]);
+        exit(0);
+      default:
+        usage(args[0]);
+        exit(1);
+    }
+  }
+
+  if (extract.path) {
+    if (nb_queries > 0) {
+      fprintf(stderr, "--extract-bin cannot be used with --query\n");
+      exit(1);
+    }
+    if (0 != mkdir(extract.dir, 0755) && errno != EEXIST) {
+      fprintf(stderr, "Cannot create directory '%s': %s\n", extract.dir, strerror(errno));
+      exit(1);
+    }
+  }
+
   char *fname;
-  switch (nb_args) {
-    case 1:
+  switch (nb_args - optind) {
+    case 0:
       fname = "/dev/stdin";
       break;
-    case 2:
-      fname = args[1];
+    case 1:
+      fname = args[optind];
       break;
     default:
-      printf("%s [file]\n", args[0]);
+      usage(args[0]);
       exit(1);
   }
 
@@ -364,13 +3745,45 @@ int main(int nb_args, char **args)
     exit(1);
   }
 
+  fixint_strs_ctor();
+  simd_ctor();
+  ext_ctor();
+  if (ext_plugins_dir && ! ext_plugins_load(ext_plugins_dir)) exit(1);
+  PROF_CTOR();
+  if (stats.enabled) stats_ctor();
+  progress_ctor(fd);
+  if (latency.enabled) atexit(latency_report);
+  if (perf.enabled) perf_ctor();
+
+  if (nb_queries > 0) {
+    bool ok = run_queries(fd, fname, use_tape_cache, queries, nb_queries, mode);
+    out_flush();
+    for (unsigned q = 0; q < nb_queries; q++) query_dtor(queries + q);
+    free(queries);
+    arena_dtor(&arena);
+    close(fd);
+    return ok ? 0 : 1;
+  }
+
   struct ctx ctx;
-  ctx_ctor(&ctx, fd);
+  if (! ctx_ctor(&ctx, fd)) exit(1);
   while (! ctx.eof) {
-    if (! dump(&ctx, ROLE_NONE)) {
+    size_t const offset = ctx.offset;
+    uint64_t const start = latency.enabled ? now_ns() : 0;
+    if (! mode->dump_record(&ctx)) {
+      out_flush();
       exit(1);
     }
+    if (latency.enabled && ! ctx.eof) lat_record(now_ns() - start, offset);
+    arena_reset(&arena);
+    if (! ctx.eof) stats_tick();
+    progress_tick(&ctx);
   }
 
+  out_flush();
+  arena_dtor(&arena);
+  ctx_dtor(&ctx);
+  if (extract.path) query_dtor(&extract_path);
   close(fd);
+  return 0;
 }
@@ -0,0 +1,334 @@
+/*
+ * Lazy access to msgpack values, for when only a few fields of each record
+ * are needed.
+ *
+ * Nothing is decoded until asked for: navigating into a map or an array
+ * just walks over the raw bytes, skipping siblings using their length
+ * prefixes:
+ *
+ *   msgpack_dump::value rec(msgpack_dump::span<std::byte const>(buf, len));
+ *   auto id = rec["meta"]["user"]["id"].as_int();
+ *
+ * Looking up several keys of the same map is better done through a
+ * cached_map, which remembers where each key it went past is:
+ *
+ *   msgpack_dump::cached_map<> meta(rec["meta"]);
+ *   auto user = meta["user"], host = meta["host"];
+ *
+ * Values are just pointers into the input buffer, which must outlive them.
+ * Missing keys, out of range indices and malformed input all give an
+ * invalid value, for which every accessor returns nothing.
+ */
+#ifndef MSGPACK_LAZY_HPP
+#define MSGPACK_LAZY_HPP
+
+#include <optional>
+#include "msgpack-decode.hpp"
+
+namespace msgpack_dump {
+
+namespace detail {
+
+struct header {
+  kind k;
+  // Length of str/bin/ext payloads, number of items of containers, value
+  // bits of numbers:
+  std::uint64_t n;
+  // Where the payload, or the first item, starts:
+  std::byte const *body;
+};
+
+inline bool parse_header(std::byte const *p, std::byte const *end, header &h) noexcept
+{
+  if (p >= end) return false;
+  unsigned char const fst = static_cast<unsigned char>(*p++);
+  tag_info const &ti = tag_table[fst];
+  if (ti.k == kind::bad || end - p < ti.lenlen) return false;
+  h.k = ti.k;
+  h.n = ti.lenlen ? load_be(p, ti.lenlen) : ti.fixlen;
+  if (ti.k == kind::fixint) h.n = fst;
+  if (ti.k == kind::sint) {
+    unsigned const bits = ti.lenlen * 8;
+    if (bits < 64 && (h.n >> (bits - 1))) h.n |= ~0ULL << bits;
+  }
+  h.body = p + ti.lenlen;
+  return true;
+}
+
+// Return where the value starting at p ends, or nullptr if it's malformed.
+inline std::byte const *skip(std::byte const *p, std::byte const *end) noexcept
+{
+  std::uint64_t pending = 1;
+  while (pending > 0) {
+    header h;
+    if (! parse_header(p, end, h)) return nullptr;
+    p = h.body;
+    pending --;
+    switch (h.k) {
+      case kind::str:
+      case kind::bin:
+        if (std::uint64_t(end - p) < h.n) return nullptr;
+        p += h.n;
+        break;
+      case kind::ext:
+        if (std::uint64_t(end - p) < 1 + h.n) return nullptr;
+        p += 1 + h.n;
+        break;
+      case kind::array:
+        pending += h.n;
+        break;
+      case kind::map:
+        pending += 2 * h.n;
+        break;
+      default:
+        break;
+    }
+  }
+  return p;
+}
+
+// FNV-1a
+inline std::uint32_t hash(std::string_view s) noexcept
+{
+  std::uint32_t h = 2166136261U;
+  for (char c : s) h = (h ^ static_cast<unsigned char>(c)) * 16777619U;
+  return h;
+}
+
+}  // namespace detail
+
+template<std::size_t N = 64> class cached_map;
+
+class value {
+  std::byte const *p_;
+  std::byte const *end_;  // of the buffer, not of the value
+
+  template<std::size_t N> friend class cached_map;
+
+  bool header(detail::header &h) const noexcept
+  {
+    return p_ && detail::parse_header(p_, end_, h);
+  }
+
+  template<kind K>
+  std::optional<std::string_view> payload() const noexcept
+  {
+    detail::header h;
+    if (! header(h) || h.k != K) return std::nullopt;
+    if (std::uint64_t(end_ - h.body) < h.n) return std::nullopt;
+    return std::string_view(reinterpret_cast<char const *>(h.body), h.n);
+  }
+
+public:
+  constexpr value() noexcept : p_(nullptr), end_(nullptr) {}
+  constexpr value(std::byte const *p, std::byte const *end) noexcept : p_(p), end_(end) {}
+  // The first value of buf:
+  constexpr explicit value(span<std::byte const> buf) noexcept :
+    p_(buf.data()), end_(buf.data() + buf.size()) {}
+
+  constexpr explicit operator bool() const noexcept { return p_ != nullptr; }
+
+  kind type() const noexcept
+  {
+    detail::header h;
+    return header(h) ? h.k : kind::bad;
+  }
+
+  // Raw bytes of the whole value (empty if malformed):
+  span<std::byte const> bytes() const noexcept
+  {
+    std::byte const *e = p_ ? detail::skip(p_, end_) : nullptr;
+    return e ? span<std::byte const>(p_, e - p_) : span<std::byte const>();
+  }
+
+  // The value that follows this one in the buffer, such as the next record:
+  value next() const noexcept
+  {
+    std::byte const *e = p_ ? detail::skip(p_, end_) : nullptr;
+    return e && e < end_ ? value(e, end_) : value();
+  }
+
+  // Number of items of a container, or length of a str or bin:
+  std::size_t size() const noexcept
+  {
+    detail::header h;
+    if (! header(h)) return 0;
+    switch (h.k) {
+      case kind::array: case kind::map: case kind::str: case kind::bin: return h.n;
+      default: return 0;
+    }
+  }
+
+  bool is_nil() const noexcept { return type() == kind::nil; }
+
+  std::optional<bool> as_bool() const noexcept
+  {
+    detail::header h;
+    if (! header(h) || h.k != kind::boolean) return std::nullopt;
+    return h.n != 0;
+  }
+
+  std::optional<std::int64_t> as_int() const noexcept
+  {
+    detail::header h;
+    if (! header(h)) return std::nullopt;
+    switch (h.k) {
+      case kind::fixint: return std::int8_t(h.n);
+      case kind::sint: return std::int64_t(h.n);
+      case kind::uint:
+        if (h.n > std::uint64_t(INT64_MAX)) return std::nullopt;
+        return std::int64_t(h.n);
+      default: return std::nullopt;
+    }
+  }
+
+  std::optional<std::uint64_t> as_uint() const noexcept
+  {
+    detail::header h;
+    if (! header(h)) return std::nullopt;
+    switch (h.k) {
+      case kind::fixint:
+        if (h.n & 0x80) return std::nullopt;
+        return h.n;
+      case kind::sint:
+        if (std::int64_t(h.n) < 0) return std::nullopt;
+        return h.n;
+      case kind::uint: return h.n;
+      default: return std::nullopt;
+    }
+  }
+
+  std::optional<double> as_double() const noexcept
+  {
+    detail::header h;
+    if (! header(h)) return std::nullopt;
+    switch (h.k) {
+      case kind::float32: {
+        std::uint32_t const b = std::uint32_t(h.n);
+        float f;
+        std::memcpy(&f, &b, sizeof(f));
+        return f;
+      }
+      case kind::float64: {
+        double d;
+        std::memcpy(&d, &h.n, sizeof(d));
+        return d;
+      }
+      case kind::fixint: return double(std::int8_t(h.n));
+      case kind::sint: return double(std::int64_t(h.n));
+      case kind::uint: return double(h.n);
+      default: return std::nullopt;
+    }
+  }
+
+  std::optional<std::string_view> as_str() const noexcept { return payload<kind::str>(); }
+  std::optional<std::string_view> as_bin() const noexcept { return payload<kind::bin>(); }
+
+  // Item of an array:
+  value operator[](std::size_t idx) const noexcept
+  {
+    detail::header h;
+    if (! header(h) || h.k != kind::array || idx >= h.n) return value();
+    std::byte const *p = h.body;
+    for (; idx > 0 && p; idx--) p = detail::skip(p, end_);
+    // The buffer may end before the items the array announces:
+    return p && p < end_ ? value(p, end_) : value();
+  }
+
+  // Value of a map for the given str key:
+  value operator[](std::string_view key) const noexcept
+  {
+    detail::header h;
+    if (! header(h) || h.k != kind::map) return value();
+    std::byte const *p = h.body;
+    for (std::uint64_t i = 0; i < h.n && p; i++) {
+      value const k(p, end_);
+      std::byte const *v = detail::skip(p, end_);
+      if (! v || v >= end_) break;
+      if (k.as_str() == key) return value(v, end_);
+      p = detail::skip(v, end_);
+    }
+    return value();
+  }
+};
+
+/*
+ * A map remembering where its keys are.
+ *
+ * The map is scanned no further than needed to find the requested key, and
+ * every key passed on the way is added to a hash table of N slots, so that
+ * later lookups of those keys are O(1). Once the table is full the
+ * remaining keys are searched linearly.
+ */
+template<std::size_t N>
+class cached_map {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of 2");
+
+  struct slot {
+    std::string_view key;
+    std::byte const *val = nullptr;
+  };
+
+  value map_;
+  std::byte const *end_ = nullptr;
+  // Where to resume the scan, and how many items are left to scan:
+  std::byte const *next_ = nullptr;
+  std::uint64_t left_ = 0;
+  std::size_t used_ = 0;
+  slot slots_[N];
+
+  // Find the slot of key, or the empty slot where it would go:
+  slot &find(std::string_view key) noexcept
+  {
+    std::size_t i = detail::hash(key) & (N - 1);
+    while (slots_[i].val && slots_[i].key != key) i = (i + 1) & (N - 1);
+    return slots_[i];
+  }
+
+public:
+  explicit cached_map(value m) noexcept : map_(m)
+  {
+    // Only the header is parsed here; items are bounded by the end of the
+    // buffer as they are scanned:
+    detail::header h;
+    if (! m.header(h) || h.k != kind::map) return;
+    end_ = m.end_;
+    next_ = h.body;
+    left_ = h.n;
+  }
+
+  value operator[](std::string_view key) noexcept
+  {
+    slot &s = find(key);
+    if (s.val) return value(s.val, end_);
+
+    while (left_ > 0) {
+      value const k(next_, end_);
+      std::byte const *v = detail::skip(next_, end_);
+      next_ = v ? detail::skip(v, end_) : nullptr;
+      // Stop there if malformed:
+      left_ = next_ ? left_ - 1 : 0;
+      if (! next_) break;
+      std::optional<std::string_view> const ks = k.as_str();
+      // Keep a free slot so that find() always terminates:
+      if (ks && used_ < N - 1) {
+        slot &t = find(*ks);
+        if (! t.val) {
+          t.key = *ks;
+          t.val = v;
+          used_ ++;
+        }
+      }
+      if (ks == key) return value(v, end_);
+    }
+
+    // Not cached and not found while scanning; if the table filled up the
+    // key may still be in the part that has been scanned but not cached:
+    if (used_ >= N - 1) return map_[key];
+    return value();
+  }
+};
+
+}  // namespace msgpack_dump
+
+#endif